@@ -0,0 +1,311 @@
+/***********************************************
+ * Map-Reduce benchmark
+ *
+ * Generates synthetic corpora and times MR_RunWithOptions on them for every number of mappers and reducers asked
+ *   for, each run in its own process so that its peak RSS and allocations are its own.
+ *
+ * built using : gcc -O2 -I. bench/bench.c mapreduce.c -pthread -o bench_mr
+ * usage       : ./bench_mr [-n words] [-f files] [-m 1,2,4,8] [-r 1,2,4,8] [-w uniform,zipf,...] [-d directory]
+ ***********************************************/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "mapreduce.h"
+
+#define MAX_SWEEP 16
+#define DISTINCT_KEYS 100000  // Keys of the uniform and Zipfian corpora
+#define HOT_KEYS 8  // Keys drawing 90% of the emits of the hot corpus
+#define LARGE_VALUE 1024  // Bytes of every value of the large values corpus
+#define LARGE_VALUE_RATIO 64  // Large values corpus, one pair for this many words of the other corpora
+
+// Kinds of corpora
+typedef enum workload {
+    UNIFORM,  // Words drawn uniformly from DISTINCT_KEYS keys
+    ZIPF,  // Words drawn from DISTINCT_KEYS keys with a Zipfian law of exponent 1
+    UNIQUE,  // Every word is different
+    HOT,  // A few keys make most of the words
+    LARGE,  // Lines of one key and a LARGE_VALUE bytes value
+    NUM_WORKLOADS
+} workload_t;
+
+const char *workload_names[NUM_WORKLOADS] = {"uniform", "zipf", "unique", "hot", "large"};
+
+// Counters of this process, MR_Run's allocations included
+unsigned long allocations_;
+unsigned long allocated_bytes_;
+unsigned long checksum_;  // Keeps the reducers' work from being optimized away
+
+#ifdef __GLIBC__
+// Counting versions of the allocator, the ones of glibc do the work
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&allocations_, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocated_bytes_, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocations_, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocated_bytes_, count * size, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    __atomic_add_fetch(&allocations_, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocated_bytes_, size, __ATOMIC_RELAXED);
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+// xorshift64*, each corpus file has its own generator so they are the same from one run to the other
+unsigned long next_random(unsigned long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dUL;
+}
+
+// Uniform double in [0, 1)
+double next_uniform(unsigned long *state) {
+    return (next_random(state) >> 11) * (1.0 / (1UL << 53));
+}
+
+// Cumulated probabilities of the Zipfian keys, searched with a uniform draw
+double *zipf_table() {
+    double *cdf = malloc(DISTINCT_KEYS * sizeof(double));
+    assert(cdf != NULL);
+    double sum = 0;
+    for (int i = 0; i < DISTINCT_KEYS; i++) {
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+    for (int i = 0; i < DISTINCT_KEYS; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+long draw_zipf(const double *cdf, unsigned long *state) {
+    double u = next_uniform(state);
+    long low = 0, high = DISTINCT_KEYS - 1;
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (cdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Writes a corpus file of about num_words words, 16 words per line
+void write_corpus(const char *file_name, workload_t workload, long num_words, int file_number, const double *cdf) {
+    FILE *file = fopen(file_name, "w");
+    assert(file != NULL);
+    unsigned long state = 0x9e3779b97f4a7c15UL * (file_number + 1);
+    if (workload == LARGE) {
+        char value[LARGE_VALUE + 1];
+        for (long i = 0; i < num_words / LARGE_VALUE_RATIO; i++) {
+            for (int j = 0; j < LARGE_VALUE; j++) {
+                value[j] = 'a' + next_random(&state) % 26;
+            }
+            value[LARGE_VALUE] = '\0';
+            fprintf(file, "k%lu %s\n", next_random(&state) % DISTINCT_KEYS, value);
+        }
+        fclose(file);
+        return;
+    }
+    for (long i = 0; i < num_words; i++) {
+        switch (workload) {
+            case UNIFORM:
+                fprintf(file, "w%lu", next_random(&state) % DISTINCT_KEYS);
+                break;
+            case ZIPF:
+                fprintf(file, "w%ld", draw_zipf(cdf, &state));
+                break;
+            case UNIQUE:
+                fprintf(file, "u%d_%ld", file_number, i);
+                break;
+            default:
+                if (next_random(&state) % 10 != 0) {
+                    fprintf(file, "hot%lu", next_random(&state) % HOT_KEYS);
+                } else {
+                    fprintf(file, "w%lu", next_random(&state) % DISTINCT_KEYS);
+                }
+                break;
+        }
+        fputc(i % 16 == 15 ? '\n' : ' ', file);
+    }
+    fputc('\n', file);
+    fclose(file);
+}
+
+// Emits every word of the split with the value "1"
+void Map(char *file_name, long offset, long length) {
+    MR_Input input;
+    int opened = MR_OpenInput(file_name, offset, length, &input);
+    assert(opened == 0);
+    MR_EmitTokens(input.data, input.length, " \n", "1");
+    MR_CloseInput(&input);
+}
+
+// Emits the key of every line with the rest of the line as value
+void MapLarge(char *file_name, long offset, long length) {
+    MR_Input input;
+    int opened = MR_OpenInput(file_name, offset, length, &input);
+    assert(opened == 0);
+    const char *line;
+    size_t size;
+    while (MR_NextRecord(&input, &line, &size)) {
+        const char *space = memchr(line, ' ', size);
+        if (space) {
+            size_t value_length = size - (space + 1 - line) - (line[size - 1] == '\n');
+            MR_EmitN(line, space - line, space + 1, value_length);
+        }
+    }
+    MR_CloseInput(&input);
+}
+
+// Sums the counts of the key, or the bytes of its values for the large values corpus
+void Reduce(char *key, Getter get_next, int partition_number) {
+    (void) get_next;
+    unsigned long sum = 0;
+    char **values;
+    size_t num_values;
+    while ((num_values = MR_GetValues(key, partition_number, &values)) > 0) {
+        for (size_t i = 0; i < num_values; i++) {
+            sum += values[i][0] == '1' && values[i][1] == '\0' ? 1 : strlen(values[i]);
+        }
+    }
+    __atomic_add_fetch(&checksum_, sum, __ATOMIC_RELAXED);
+}
+
+// Runs the job and prints one line of results, called in a child process
+void run(workload_t workload, char **files, int num_files, int num_mappers, int num_reducers) {
+    char *argv[num_files + 2];
+    argv[0] = "bench_mr";
+    memcpy(&argv[1], files, num_files * sizeof(char *));
+    argv[num_files + 1] = NULL;
+
+    MR_Options options;
+    MR_InitOptions(&options);
+    options.split_mapper = workload == LARGE ? MapLarge : Map;
+    options.borrow_values = 1;
+    MR_Stats stats;
+    options.stats = &stats;
+    allocations_ = 0;
+    allocated_bytes_ = 0;
+
+    MR_RunWithOptions(num_files + 1, argv, NULL, num_mappers, Reduce, num_reducers, MR_DefaultHashPartition, &options);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %3d %3d %10lu %12.0f %8.3f %9.3f %8.3f %8.3f %8.3f %9.1f %10lu %10.1f\n", workload_names[workload],
+           num_mappers, num_reducers, stats.emits, stats.emits / stats.total_time, stats.map_time, stats.shuffle_time,
+           stats.reduce_time, stats.total_time, stats.lock_wait_time, usage.ru_maxrss / 1024.0, allocations_,
+           allocated_bytes_ / (1024.0 * 1024.0));
+    fflush(stdout);
+    MR_FreeStats(&stats);
+}
+
+// Parses a comma separated list of positive numbers, returns how many there are
+int parse_sweep(char *list, int *values) {
+    int count = 0;
+    for (char *item = strtok(list, ","); item && count < MAX_SWEEP; item = strtok(NULL, ",")) {
+        values[count] = atoi(item);
+        if (values[count] > 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    long num_words = 2000000;
+    int num_files = 8;
+    int mappers[MAX_SWEEP] = {1, 2, 4, 8}, num_mapper_counts = 4;
+    int reducers[MAX_SWEEP] = {1, 2, 4, 8}, num_reducer_counts = 4;
+    int workloads[NUM_WORKLOADS] = {1, 1, 1, 1, 1};
+    char *directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+    int option;
+    while ((option = getopt(argc, argv, "n:f:m:r:w:d:")) != -1) {
+        switch (option) {
+            case 'n':
+                num_words = atol(optarg);
+                break;
+            case 'f':
+                num_files = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'm':
+                num_mapper_counts = parse_sweep(optarg, mappers);
+                break;
+            case 'r':
+                num_reducer_counts = parse_sweep(optarg, reducers);
+                break;
+            case 'w':
+                memset(workloads, 0, sizeof(workloads));
+                for (char *name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                    for (int i = 0; i < NUM_WORKLOADS; i++) {
+                        workloads[i] |= strcmp(name, workload_names[i]) == 0;
+                    }
+                }
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n words] [-f files] [-m mappers,...] [-r reducers,...] "
+                                "[-w uniform,zipf,unique,hot,large] [-d directory]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    double *cdf = zipf_table();
+    char *files[num_files];
+    printf("%-8s %3s %3s %10s %12s %8s %9s %8s %8s %8s %9s %10s %10s\n", "workload", "M", "R", "emits", "emits/s",
+           "map_s", "shuffle_s", "reduce_s", "total_s", "lock_s", "rss_MiB", "allocs", "alloc_MiB");
+    fflush(stdout);  // Or the children print it again
+    for (int w = 0; w < NUM_WORKLOADS; w++) {
+        if (!workloads[w]) {
+            continue;
+        }
+        for (int i = 0; i < num_files; i++) {  // The corpus is generated once for the whole sweep
+            files[i] = malloc(strlen(directory) + 64);
+            assert(files[i] != NULL);
+            sprintf(files[i], "%s/mr_bench_%d_%s_%d.txt", directory, (int) getpid(), workload_names[w], i);
+            write_corpus(files[i], w, num_words / num_files, i, cdf);
+        }
+        for (int m = 0; m < num_mapper_counts; m++) {
+            for (int r = 0; r < num_reducer_counts; r++) {
+                pid_t child = fork();
+                if (child == 0) {
+                    run(w, files, num_files, mappers[m], reducers[r]);
+                    _exit(0);
+                }
+                int status;
+                waitpid(child, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "%s: run with %d mappers and %d reducers failed\n",
+                            workload_names[w], mappers[m], reducers[r]);
+                }
+            }
+        }
+        for (int i = 0; i < num_files; i++) {
+            unlink(files[i]);
+            free(files[i]);
+        }
+    }
+    free(cdf);
+    return 0;
+}
@@ -13,36 +13,55 @@
 #include <string.h>
 #include "mapreduce.h"
 
-void Map(char *file_name) {
-    FILE *fp = fopen(file_name, "r");
-    assert(fp != NULL);
-
-    char *line = NULL;
-    size_t size = 0;
-    while (getline(&line, &size, fp) != -1) {
-        char *token, *dummy = line;
-        while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
-            MR_Emit(token, "1");
-        }
-    }
-    free(line);
-    fclose(fp);
+// Emits every word of the split, the input is mapped in memory so words are emitted without intermediate copies
+void Map(char *file_name, long offset, long length) {
+    MR_Input input;
+    int opened = MR_OpenInput(file_name, offset, length, &input);
+    assert(opened == 0);
+    MR_EmitTokens(input.data, input.length, " \t\n\r", "1");
+    MR_CloseInput(&input);
 }
 
 
 
-void Reduce(char *key, Getter get_next, int partition_number) {
-    int count = 0;
+// Sums the counts a mapper gathered for the word before they reach the partition
+char *Combine(char *key, Getter get_next, int partition_number) {
+    long count = 0;
     char *value;
     while ((value = get_next(key, partition_number)) != NULL){
-        count++;
-        free(value);
+        count += atol(value);
+    }
+    char *combined = malloc(21);
+    assert(combined != NULL);
+    snprintf(combined, 21, "%ld", count);
+    return combined;
+}
+
+
+
+void Reduce(char *key, Getter get_next, int partition_number) {
+    (void) get_next; // values are read in batches, without a call per value
+    long count = 0;
+    char **values;
+    size_t num_values;
+    while ((num_values = MR_GetValues(key, partition_number, &values)) > 0){
+        for (size_t i = 0; i < num_values; i++){
+            count += atol(values[i]); // values are either "1" or partial counts from Combine
+        }
     }
-    printf("%s %d\n", key, count); // word "key" appears "count" times
+    char count_string[21];
+    snprintf(count_string, sizeof(count_string), "%ld", count);
+    MR_Output(key, count_string); // word "key" appears "count" times
 }
 
 
 
 int main(int argc, char *argv[]) {
-    MR_Run(argc, argv, Map, 8, Reduce, 8, MR_DefaultHashPartition);
+    MR_Options options;
+    MR_InitOptions(&options);
+    options.combiner = Combine;
+    options.borrow_values = 1; // values are only read, no need for get_next to copy them
+    options.split_mapper = Map;
+    options.pipeline = 1; // counts are combined by the reducers while the files are still being mapped
+    MR_RunWithOptions(argc, argv, NULL, 8, Reduce, 8, MR_DefaultHashPartition, &options);
 }
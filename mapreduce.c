@@ -1,230 +1,4125 @@
+#define _GNU_SOURCE  // CPU affinity of the threads
 #include "mapreduce.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <time.h>
 /************************************************************************************************************************
- * The chosen data structure for this project is a two leveled thread safe linked list                                  *
+ * The chosen data structure for this project is a thread safe open addressing hash table of keys, each key holding    *
+ *   a linked list of its values.                                                                                       *
  * The choice was motivated by the nature of the MapReduce problem,                                                     *
- *   since linked lists allow dynamic inserts, deletes and using a lock makes them safe for multi-thread programs.      *
- * The partition linked list uses nodes of level 1 (entry_t) corresponding to the keys.                                 *
- * The entry_t linked list uses nodes of level 2 (values_t) where the associated values will be stored.                 *
+ *   since every MR_Emit has to find the key it belongs to, and a hash table makes that lookup amortized O(1).          *
+ * Every partition owns a table of slots (slot_t) pointing to the entries (entry_t) corresponding to the keys.          *
+ * The entry_t linked list uses nodes of level 2 (values_t) where the associated values will be stored, each node     *
+ *   holding an array of values twice as big as the previous one, so reading them doesn't miss the cache every value.  *
  * The values are directly grouped together in the mapping phase following the next execution :                         *
- *   ->Finding an entry with the same key (O(n) in worst case).                                                         *
- *   ->Inserting the value at the beginning (O(1)).                                                                     *
+ *   ->Hashing the key once and probing the table linearly, the stored hash is compared before strcmp (O(1) amortized). *
+ *     The 64 bit hash reads the key 8 bytes at a time, its high bits pick the partition and its low bits the slot.     *
+ *   ->Appending the value to the first node, or to a new first node once it is full (O(1)).                           *
+ *   ->Doubling the table once it is 3/4 full, the stored hashes avoid rehashing the keys.                              *
+ * The map phase runs exactly num_mappers threads, each one taking the next file from a queue sorted by decreasing     *
+ *   size, so the biggest files are started first and no thread waits while others still have files to map.           *
+ * With a split mapper, files bigger than split_size are cut into splits starting right after a newline, which are      *
+ *   queued the same way so that one big file keeps every mapper busy.                                                  *
+ * With prefetch, a helper thread follows the queue a few tasks ahead of the mappers and reads them ahead in the page *
+ *   cache (readahead, or pread when the file system doesn't support it), so mappers don't wait on slow storage.       *
+ * Mappers can read their input through MR_OpenInput, which maps the file instead of copying it, and emit the records'*
+ *   they cut with MR_EmitN, keys and values being copied once, in the arena, without a NUL terminated intermediate.    *
+ * Keys are hashed, compared and sent with their length, so MR_EmitBytes takes binary keys as they are. Values of the *
+ *   sort shuffle are records with a length, in the tables they are preceded by a 32 bit length with binary_values,   *
+ *   which MR_GetBytes returns along with the value, without a copy.                                                  *
+ * The C++ front-end (mapreduce.hpp) picks the partition of its typed keys itself and emits their bytes with         *
+ *   MR_EmitPartitioned, and its Combiners return bytes through MR_CombinedBytes, whose length precedes the value.    *
+ * MR_Tokenize finds the delimiters 16 or 32 bytes at a time (SSE2, AVX2 when the CPU has it, NEON), a mask of the    *
+ *   matching bytes giving the token boundaries, and skips the empty tokens between consecutive delimiters.            *
+ * Every mapper thread first groups its emits in private tables (buffer_t), one per partition, which are merged in the *
+ *   shared partition once they hold batch_size emits and when the mapper exits, so the partition lock is taken once   *
+ *   per batch instead of once per emit.                                                                                *
+ *   A key whose values fill a big share of a batch is hot: they are combined in the buffer right away, or without a  *
+ *   combiner left out of the batch, so skewed keys don't flush (and lock) their partition more often than the others. *
+ * When a combiner is given, the values a buffer holds for a key are combined into one before being merged.             *
+ * With the sort shuffle, buffers are plain arrays of records (record_t) instead, which are sorted by key with a       *
+ *   multikey quicksort when flushed and kept as runs (run_t) of their partition. Before reducing a partition, its runs *
+ *   are merged with a heap (merge_t), so the keys reach the Reducer in byte order, with their values next to each other*
+ * When the runs held in memory exceed memory_limit, the runs of the biggest partition are merged into a spill file,   *
+ *   which is read back like any other run when the partition is reduced.                                              *
+ *   Spilled keys only store what follows the prefix they share with the previous key, lengths are varints, and a      *
+ *   value equal to the previous one is a single byte. With compress_values, equal values emitted one after the other  *
+ *   share their copy in memory.                                                                                       *
+ * In pipeline mode, reducer threads run during the map phase: mappers hand their full buffers over to the reducer of *
+ *   the partition (batch_t), which merges and combines them in a table only it touches while mapping goes on.          *
+ * There can be more partitions than reducer threads: reducers take the partitions from a queue sorted by decreasing   *
+ *   estimated size, so that a big partition is started early instead of ending the reduce phase on its own.          *
+ *   In pipeline mode, partition p's batches are merged by the reducer p % num_reducers before the queue is used.       *
+ * MR_RangePartition gives partition p the keys between the range splits p - 1 and p, found by binary search. Unless  *
+ *   they are given, the mappers first run on the beginning of the splits with their emits kept in per thread          *
+ *   reservoirs, and the splits are evenly spaced keys of the sorted samples, so the partitions hold similar shares.   *
  * Locks are only used in the mapping phase on a partition tp deal with concurrency, but not                            *
  *   in the reducing phase since a partition is being accessed by one thread only.                                      *
- * One line has been added to the Reduce function to match the code structure thus avoiding memory leaks.               *
- * When getting the next value in the reduce phase, the 2nd level node is deleted and the head points to its next,      *
- *   resulting in a O(1) for every value read.                                                                          *
+ * One line has been added to the Reduce function to match the code structure thus avoiding memory leaks,              *
+ *   unless borrow_values is set, in which case get_next returns the stored values without copying them.               *
+ * When getting the next value in the reduce phase, the last value of the first node is taken, and once the node is   *
+ *   empty the head points to its next, resulting in a O(1) for every value read. MR_GetValues returns a whole node.    *
+ * The entry being reduced is kept in a thread local cursor, so get_next doesn't search the partition for its key.      *
+ * Entries, values and their strings are carved from arenas (arena_t), one per mapper thread and one per partition for *
+ *   emits made outside of the mappers, so threads don't contend on malloc, and the arenas are freed in bulk at the end. *
+ * MR_Output appends the reduced pairs to a buffer of the reducer thread, written in blocks of OUTPUT_BUFFER_SIZE to  *
+ *   the file of the partition. Without an output directory, a partition's output stays in memory (or in an unlinked  *
+ *   temporary file once it outgrows the buffer), and the partitions are written one after the other at the end.     *
+ * With top_k, MR_Output copies the pair into a heap of the partition (top_t) instead, when it ranks before the worst *
+ *   of the top_k kept, and the heaps are merged and sorted at the end. The built-in Reducers and Combiners (count,    *
+ *   sum, min, max) read whole blocks of values with MR_GetValues, without the Getter or any copy.                    *
+ * With the numa option, mapper and reducer threads are pinned to the NUMA nodes round robin, and each partition has  *
+ *   the node of the reducer p % num_reducers: its tables, sorted runs and direct emits are placed there (mbind), and  *
+ *   reducers reduce the partitions of their node before helping the other nodes.                                      *
+ * In stream mode, the values of every key are combined while the partition is reduced and kept in the context       *
+ *   (stream_state_t), and the mappers of the next run emit them again after their files: each run only maps the new  *
+ *   input, and the Reducer sees the values of the whole stream.                                                        *
+ * A run can span several processes given the same cluster (host:port of each): process 0 keeps the queue of tasks  *
+ *   and hands them out to the mappers of all, and partition p belongs to process p % processes. Mapper buffers of the *
+ *   partitions of other processes are combined and sent to them as frames over TCP once full, where a receiver thread *
+ *   per connection emits them again like a mapper. Each process reduces its partitions once every process is done.   *
+ * With task_attempts, every map task runs in a child process writing the frames of its emits to a file, which its   *
+ *   mapper thread emits once the child exits normally. It is run again when the child crashes, and once the queue is *
+ *   empty idle mappers start copies of the stragglers, the first attempt to succeed kills the other one. Outputs kept *
+ *   in checkpoint_directory are emitted by the next runs instead of mapping their task again.                         *
+ * The state of a run lives in a context (MR_Context) reached through a thread local pointer, so that several runs can *
+ *   go on at once. A context keeps its threads (worker_t) and the arena chunks of its last run for the next one.       *
+ * The counters of MR_Stats are kept per thread (busy times) or only updated once per chunk, table or contended lock,  *
+ *   so they are always on, MR_Run only copies them in the stats it is given.                                          *
  ***********************************************************************************************************************/
 
 
 
 
-// Level 2 node (values associated with the key)
+// Block of memory nodes and strings are allocated from
+typedef struct chunk {
+    struct chunk* next;
+    size_t size;  // Usable bytes in data
+    size_t used;
+    char* last_value;  // compress_values, last value copied in the chunk, which the next equal value shares
+    size_t last_value_length;
+    char data[];
+} chunk_t;
+
+// Bump allocator, memory is only released when the whole arena is freed
+typedef struct arena {
+    chunk_t* head;  // Chunk being filled
+    size_t size;  // Bytes of all the chunks
+    int node;  // NUMA node the chunks are placed on, -1 to let the system choose
+    struct arena* next;  // Next arena of the run
+} arena_t;
+
+// Level 2 node (block of values associated with the key)
 typedef struct values {
-    char* value;
     struct values* next;
+    int count;  // Values stored, the next value goes at values[count]
+    int capacity;
+    char* values[];
 } values_t;
 
-// Level 1 node (entries associated with keys)
-typedef struct entry {
-    char* key;
-    struct entry* next;
-    values_t* head;  // Head of the Level 2 node list (values)
-} entry_t;
+// Level 1 node (entries associated with keys)
+typedef struct entry {
+    char* key;
+    size_t key_length;
+    unsigned long hash;  // Hash of the key, computed once when the entry is created
+    values_t* head;  // Head of the Level 2 node list (values), the only node that isn't full
+} entry_t;
+
+// Slot of a table, the hash is kept next to the pointer so probing doesn't touch the entry
+typedef struct slot {
+    unsigned long hash;
+    entry_t* entry;  // NULL if the slot is empty
+} slot_t;
+
+// Open addressing hash table of entries
+typedef struct table {
+    slot_t* slots;
+    unsigned long capacity;  // Always a power of two
+    unsigned long count;     // Number of entries in the table
+    int node;  // NUMA node the slots are placed on, -1 to let the system choose
+} table_t;
+
+// Key and value emitted with the sort shuffle
+typedef struct record {
+    char* key;
+    size_t key_length;
+    char* value;
+    size_t value_length;
+} record_t;
+
+// Records of a flushed buffer, sorted by key
+typedef struct run {
+    record_t* records;  // NULL once spilled
+    size_t count;
+    arena_t arena;  // Strings of the records
+    FILE* file;  // Spill file the records were written to, NULL if they are in memory
+    struct run* next;
+} run_t;
+
+// Emits of a mapper thread waiting to be merged in one partition
+typedef struct buffer {
+    table_t table;  // Hash shuffle, values grouped by key
+    record_t* records;  // Sort shuffle, records in emit order
+    arena_t arena;  // Sort shuffle, strings of the records, handed over to the run
+    int capacity;  // Of records
+    int num_emits;
+    int num_hot;  // Hash shuffle, emits of hot keys left out of the batch (combined, or held without a combiner)
+    int remote;  // The partition is reduced by another process, the buffer is sent to it (entries in arena, not arena_)
+} buffer_t;
+
+// Buffer handed over by a mapper in pipeline mode
+typedef struct batch {
+    table_t table;
+    int partition_number;
+    int num_emits;
+    struct batch* next;
+} batch_t;
+
+// Batches waiting to be merged by a reducer in pipeline mode
+typedef struct inbox {
+    batch_t* batches;
+    int closed;  // Set once the map phase is over
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // Signaled when batches are added or the inbox is closed
+} inbox_t;
+
+// Pair output by a Reducer with its numeric value (top_k)
+typedef struct ranked {
+    record_t record;  // Key and value copied with malloc
+    double score;
+} ranked_t;
+
+// Best pairs output in a partition, a heap whose root is the worst of them, replaced first
+typedef struct top {
+    ranked_t* pairs;  // top_k of them, allocated by the first pair
+    int count;
+} top_t;
+
+// Hash table structure for thread safety
+typedef struct partition {
+    table_t table;
+    run_t* runs;  // Sort shuffle
+    size_t memory;  // Sort shuffle, bytes of the runs held in memory
+    buffer_t pending;  // Records (sort shuffle) or values (pipeline mode) emitted outside of the mapper buffers
+    size_t size;  // Emits merged in the partition, estimates the work of reducing it
+    size_t keys;  // Distinct keys reduced
+    int output_fd;  // File MR_Output writes the partition to, -1 until the first block is written
+    char* output;  // Whole output of the partition when it fit in the buffer, until it is concatenated
+    size_t output_length;
+    top_t top;  // top_k, best pairs the partition output
+    arena_t arena;  // Used by emits made outside of the mapper threads
+    pthread_mutex_t lock;
+} partition_t;
+
+// Next record of a run being merged
+typedef struct run_cursor {
+    record_t* next;
+    size_t remaining;  // Records left, next included
+    FILE* file;  // Spilled runs are read back record by record in current
+    record_t current;
+    size_t key_capacity;
+    size_t value_capacity;
+} run_cursor_t;
+
+// k-way merge of runs, a binary heap of cursors ordered by the key of their next record
+typedef struct merge {
+    run_cursor_t** heap;
+    int size;
+    char* key;  // Copy of the key whose values are being read
+    size_t key_length;
+    size_t key_capacity;
+    record_t current;  // Last spilled record read
+    arena_t values;  // Copies of the spilled values read for the key
+} merge_t;
+
+// Input file, or part of a file, waiting to be mapped
+typedef struct map_task {
+    char* file_name;
+    long offset;
+    long length;  // -1 if the file couldn't be stat'ed, the mapper deals with it
+} map_task_t;
+
+// Map task run in child processes by a mapper thread, with maybe a speculative copy run by another one
+typedef struct task_run {
+    map_task_t* task;  // NULL when the mapper isn't running a task
+    double start;
+    pid_t pids[2];  // Children of the mapper and of the copy, 0 if none is running
+    int done;  // Set by the first attempt that succeeds, whose output is emitted
+    int speculated;  // 1 while a copy runs, 2 once it is done
+} task_run_t;
+
+// Stream, records of a partition kept for the next run, the result of combining the values of every key
+typedef struct stream_state {
+    record_t* records;
+    size_t count;
+    size_t capacity;
+    arena_t arena;  // Strings of the records, a key is shared by its records
+} stream_state_t;
+
+// Keys a sampling thread kept from the ones it emitted, a uniform sample of them (reservoir sampling)
+typedef struct sample {
+    record_t* keys;  // Only the keys are set, malloc'd
+    size_t count;
+    size_t capacity;
+    unsigned long seen;  // Keys emitted so far
+} sample_t;
+
+#define INITIAL_CAPACITY 64
+#define MIN_VALUES 2  // Values held by the first node of a key
+#define MAX_VALUES 512  // Nodes stop growing at this many values
+#define MAX_SPAN 256  // Values MR_GetValues gathers at once with the sort shuffle
+#define OUTPUT_BUFFER_SIZE (1 << 20)  // Output of a reducer thread written at once
+#define MAX_NODES 64  // NUMA nodes the threads and partitions are spread on
+#define MAX_VECTOR_DELIMITERS 8  // Beyond that the tokenizer looks every byte up in a table
+#define DEFAULT_DELIMITERS " \t\n\r"
+#define MPOL_PREFERRED 1  // From linux/mempolicy.h, the pages go to the node unless it is out of memory
+#define DEFAULT_BATCH_SIZE 4096
+#define HOT_KEY_SHARE 8  // A key holding 1 / HOT_KEY_SHARE of a mapper buffer's batch is hot
+#define HOT_BATCH_FACTOR 16  // Emits a buffer holds at most, in batches, however many are hot
+#define CHUNK_SIZE (1 << 20)
+#define DEFAULT_SPLIT_SIZE (64L << 20)
+#define MAX_SPILL_FILES 32  // Per partition, beyond that spill files are merged together
+#define SAMPLES_PER_PARTITION 100  // Keys kept by each sampling thread for every partition
+#define SAMPLE_BYTES (16L << 20)  // Input read to sample the keys, spread over the splits
+#define MIN_SAMPLE_WINDOW (64L << 10)  // Bytes read at least at the beginning of a sampled split
+#define FRAME_HEADER 8  // Partition and payload length of a frame sent to another process, network order
+#define END_OF_DATA 0xffffffffu  // Partition of the last frame a process sends to another
+#define NO_MORE_TASKS 0xffffffffu  // File name length the coordinator answers once the queue is empty
+#define CONNECT_ATTEMPTS 600  // Every 100 ms, the other processes of the cluster may start later
+#define HELLO_DATA 1  // The connection carries frames for the partitions of the process
+#define HELLO_TASKS 2  // The connection asks the coordinator for map tasks
+#define SPECULATION_FACTOR 2  // A task running for this many times the average task gets a copy
+#define MIN_SPECULATION_TIME 1.0  // Seconds, shorter tasks are never copied
+#define SPECULATION_POLL 100000  // Microseconds between two looks at the running tasks
+#define PREFETCH_BLOCK (1 << 20)  // Bytes read at once when the file system doesn't read ahead
+#define MAX_SAMPLE_FILES 4  // Without a split mapper, whole files are mapped to sample them
+
+
+// Thread of a context's pool, runs the functions it is handed until the context is destroyed
+typedef struct worker {
+    pthread_t thread;
+    MR_Context* context;
+    void (*function)(void*);
+    void* argument;
+    int state;  // WORKER_IDLE, WORKER_RUNNING or WORKER_FINISHED, changed under lock and read atomically
+    int exiting;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct worker* next;
+} worker_t;
+
+#define WORKER_IDLE 0
+#define WORKER_RUNNING 1
+#define WORKER_FINISHED 2  // Until the function is joined
+
+// State of a run, kept between the runs of a context along with its threads and its free chunks
+struct MR_Context {
+    partition_t *partitions;
+    int num_partitions;
+    Partitioner partitioner; //MrDefaultHash by default
+    int batch_size;
+    Combiner combiner; //NULL if values should not be combined
+    int borrow_values; //get_next returns the stored values instead of copies
+    int compress_values; //Equal values following each other in an arena are stored once
+    int binary_values; //Values of the hash shuffle are stored after their length, they may hold NUL bytes
+    MR_Shuffle shuffle;
+    size_t memory_limit; //Bytes of runs kept in memory before spilling, 0 for no limit
+    size_t memory_used; //Bytes of runs in memory, only accessed atomically
+    char* spill_directory;
+    int pipeline; //Reducers merge the mappers' buffers during the map phase
+    char* output_directory; //Partitions are output to their own file in it, NULL to concatenate them
+    char* output_file; //Where the partitions are concatenated, NULL for the standard output
+    unsigned long hash_seed;
+    int num_reducers;
+    inbox_t* inboxes; //Pipeline mode, one per reducer
+    pthread_barrier_t reduce_barrier; //Pipeline mode, reducers wait for each other before taking partitions
+    int* reduce_tasks; //Partitions to reduce, biggest first
+    int next_reduce_task; //Index of the next partition to hand out, only accessed atomically
+    int numa; //Threads are pinned and partitions placed on the NUMA nodes
+    int node_tasks[MAX_NODES + 1]; //NUMA, the tasks of node n are reduce_tasks[node_tasks[n]] to [node_tasks[n + 1]]
+    int next_node_task[MAX_NODES]; //NUMA, next task of every node, only accessed atomically
+    arena_t* arenas; //Arenas of the mapper threads
+    chunk_t* free_chunks; //Chunks of CHUNK_SIZE bytes left by the previous runs, reused by the arenas
+    pthread_mutex_t arenas_lock; //Also protects free_chunks
+    map_task_t* map_tasks; //Files to map, biggest first
+    int num_map_tasks;
+    int next_map_task; //Index of the next task to hand out, only accessed atomically
+    int prefetch; //Map tasks read ahead of the mappers by a helper thread, 0 for none
+    int prefetch_done; //Set once the mappers are done, under prefetch_lock
+    pthread_mutex_t prefetch_lock;
+    pthread_cond_t prefetch_changed; //Signaled when a mapper takes a task or the map phase is over
+    record_t* range_splits; //MR_RangePartition, sorted keys separating the partitions, num_range_splits + 1 partitions
+    int num_range_splits;
+    int owns_range_splits; //The splits were sampled and must be freed
+    int num_sample_tasks; //Tasks mapped to sample the keys, every sample_stride th one of the queue
+    int sample_stride;
+    int next_sample_task; //Only accessed atomically
+    unsigned long total_emits; //Only accessed atomically, like the counters below
+    unsigned long lock_wait; //Nanoseconds spent waiting for partition locks
+    unsigned long hot_keys; //Times a mapper buffer found a hot key
+    size_t bytes_allocated; //Arena chunks, table slots and record arrays
+    double* mapper_busy; //Seconds each mapper thread spent in the Mapper
+    double* reducer_busy; //Seconds each reducer thread spent merging batches and reducing
+    double reduce_start; //Time the first partition could be reduced
+    int stream; //The records reduced are kept to be replayed by the next run
+    stream_state_t* stream_states; //Stream, records kept by this run, one per partition
+    int num_stream_states;
+    stream_state_t* replay_states; //Stream, records kept by the previous run, emitted again by the mappers
+    int num_replay_states;
+    int next_replay_state; //Only accessed atomically
+    worker_t* workers; //Thread pool, grown to the most threads a run needed at once
+    int num_nodes; //Processes of the cluster, 1 for a local run, partition p is reduced by process p % num_nodes
+    int node; //Index of this process in the cluster, process 0 is the coordinator handing the map tasks out
+    int* node_fds; //Connections frames are sent on to the other processes, -1 for this one
+    pthread_mutex_t* node_locks; //One frame at a time on each connection
+    int coordinator_fd; //Connection to ask the coordinator for map tasks, -1 on the coordinator
+    pthread_mutex_t coordinator_lock;
+    worker_t** cluster_threads; //Receivers of the frames of the other processes, and the coordinator's task servers
+    int num_cluster_threads;
+    int num_reduce_tasks; //Partitions this process reduces
+    int task_attempts; //Map tasks run in child processes, attempted up to this many times, 0 to map in the threads
+    char* checkpoint_directory; //Where the outputs of the tasks run in child processes are kept for the next runs
+    char* checkpoint_id; //Given by the job, names its checkpoints along with the options deciding their frames
+    task_run_t* task_runs; //Task of every mapper thread, under task_lock
+    int num_task_runs;
+    double task_time; //Seconds the tasks that succeeded took, to find the stragglers
+    int num_timed_tasks;
+    pthread_mutex_t task_lock;
+    pthread_cond_t task_changed; //Signaled when a speculative copy is done
+    int top_k; //Pairs output kept by the partitions' heaps, 0 to output them all
+};
+
+MR_Context* running_context_; //Last context started, for emits made by threads the runs didn't start
+__thread MR_Context* context_; //Context of the run the calling thread works for
+__thread entry_t* current_entry_; //Entry being reduced by the calling thread
+__thread merge_t* current_merge_; //Runs being reduced or combined by the calling thread, with the sort shuffle
+__thread buffer_t* buffers_; //Emit buffers of the calling mapper thread, one per partition
+__thread unsigned long emits_; //Emits of the calling mapper thread, added to total_emits when it exits
+__thread arena_t* arena_; //Arena of the calling mapper thread
+__thread char* span_[MAX_SPAN]; //Values returned by MR_GetValues with the sort shuffle
+__thread char* output_buffer_; //MR_Output, pairs of the partition being reduced not written yet
+__thread size_t output_used_;
+__thread int output_partition_ = -1; //Partition being reduced by the calling thread
+__thread sample_t* reservoir_; //Set while the calling thread maps to sample the keys, its emits only go there
+__thread int pinned_; //The calling thread was pinned to a NUMA node by the current run
+__thread char* frame_; //Frame being sent to another process by the calling thread
+__thread size_t frame_capacity_;
+__thread int task_fd_ = -1; //Child process of a task, every pair emitted goes to this file
+__thread char* combined_bytes_; //Last value MR_CombinedBytes made for the calling thread's Combiner
+int num_nodes_ = 1; //NUMA nodes of the host, found once for the process
+int node_ids_[MAX_NODES];
+cpu_set_t node_cpus_[MAX_NODES];
+cpu_set_t process_cpus_; //Affinity the pinned threads get back after their run
+pthread_once_t nodes_once_ = PTHREAD_ONCE_INIT;
+
+// Adds the CPUs or nodes of a sysfs list like "0-3,8-11" to the set, returns how many there are
+int parse_cpu_list(const char* list, cpu_set_t* set, int* ids, int max_ids) {
+    int count = 0;
+    while (*list >= '0' && *list <= '9') {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+        for (long i = first; i <= last; i++) {
+            if (set && i < CPU_SETSIZE) {
+                CPU_SET(i, set);
+            }
+            if (ids && count < max_ids) {
+                ids[count] = (int) i;
+            }
+            count++;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Reads the online NUMA nodes and their CPUs from sysfs, a host without them has a single node
+void discover_nodes() {
+    sched_getaffinity(0, sizeof(cpu_set_t), &process_cpus_);
+    char list[4096];
+    FILE* file = fopen("/sys/devices/system/node/online", "r");
+    if (!file) {
+        return;
+    }
+    int num_nodes = fgets(list, sizeof(list), file) ? parse_cpu_list(list, NULL, node_ids_, MAX_NODES) : 0;
+    fclose(file);
+    if (num_nodes > MAX_NODES) {
+        num_nodes = MAX_NODES;
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_ids_[i]);
+        CPU_ZERO(&node_cpus_[i]);
+        file = fopen(path, "r");
+        if (!file || !fgets(list, sizeof(list), file) || parse_cpu_list(list, &node_cpus_[i], NULL, 0) == 0) {
+            num_nodes = 1;  // Can't tell the nodes apart, no placement
+            if (file) {
+                fclose(file);
+            }
+            break;
+        }
+        fclose(file);
+    }
+    if (num_nodes > 1) {
+        num_nodes_ = num_nodes;
+    }
+}
+
+// Node of the n th mapper or reducer thread, the threads are spread round robin
+int thread_node(int thread_number) {
+    return thread_number % num_nodes_;
+}
+
+// Node of the reducer that merges the partition's batches in pipeline mode, where its memory is placed
+int partition_node(int partition_number) {
+    return context_->numa ? thread_node(partition_number % context_->num_reducers) : -1;
+}
+
+void pin_thread(int node) {
+    if (num_nodes_ > 1) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus_[node]);
+        pinned_ = 1;
+    }
+}
+
+// Asks for the pages of the range not touched yet to be allocated on the node, partial pages are left as they are
+void place_on_node(void* pointer, size_t size, int node) {
+    if (node < 0 || num_nodes_ < 2) {
+        return;
+    }
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) pointer + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) pointer + size) & ~(page - 1);
+    if (end > start) {
+        unsigned long mask = 1UL << node_ids_[node];
+        syscall(SYS_mbind, (void*) start, end - start, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+}
+
+// Pool thread, waits for a function to run on behalf of its context
+void* work_(worker_t* worker) {
+    context_ = worker->context;
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (worker->state != WORKER_RUNNING && !worker->exiting) {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        }
+        if (worker->state != WORKER_RUNNING) {  // Exiting
+            break;
+        }
+        pthread_mutex_unlock(&worker->lock);
+        worker->function(worker->argument);
+        if (pinned_) {  // The next run may not pin its threads
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &process_cpus_);
+            pinned_ = 0;
+        }
+        pthread_mutex_lock(&worker->lock);
+        __atomic_store_n(&worker->state, WORKER_FINISHED, __ATOMIC_RELAXED);
+        pthread_cond_signal(&worker->changed);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+// Runs the function on an idle thread of the pool, started if they are all busy, like pthread_create would
+worker_t* pool_start(void (*function)(void*), void* argument) {
+    worker_t* worker = context_->workers;
+    // Only the thread running the job starts and joins, nobody else makes a thread idle
+    while (worker && __atomic_load_n(&worker->state, __ATOMIC_RELAXED) != WORKER_IDLE) {
+        worker = worker->next;
+    }
+    if (!worker) {
+        worker = calloc(1, sizeof(worker_t));
+        assert(worker);
+        worker->context = context_;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->changed, NULL);
+        int created = pthread_create(&worker->thread, NULL, (void *) work_, (void *) worker);
+        assert(created == 0);
+        worker->next = context_->workers;
+        context_->workers = worker;
+    }
+    pthread_mutex_lock(&worker->lock);
+    worker->function = function;
+    worker->argument = argument;
+    __atomic_store_n(&worker->state, WORKER_RUNNING, __ATOMIC_RELAXED);
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+    return worker;
+}
+
+// Waits for the function the thread runs to return, the thread is then idle
+void pool_join(worker_t* worker) {
+    pthread_mutex_lock(&worker->lock);
+    while (worker->state != WORKER_FINISHED) {
+        pthread_cond_wait(&worker->changed, &worker->lock);
+    }
+    __atomic_store_n(&worker->state, WORKER_IDLE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Multiplies a by b on 128 bits and folds the result on 64 bits
+uint64_t fold_multiply(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));  // Unaligned and compiled to a single load
+    return v;
+}
+
+uint64_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Seeded 64 bit hash of the key in the style of wyhash, shared by the default partitioner and the tables
+unsigned long hash_key(const char* key, size_t length) {
+    static const uint64_t secret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+                                       0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+    const unsigned char* p = (const unsigned char*) key;
+    uint64_t hash_seed = context_ ? context_->hash_seed : 0;  // MR_DefaultHashPartition may be called outside of a run
+    uint64_t seed = hash_seed ^ fold_multiply(hash_seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (length <= 16) {
+        if (length >= 4) {  // Two overlapping reads from each end cover the key
+            size_t shift = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - shift);
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {  // Three independent lanes let the multiplications overlap
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = fold_multiply(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = fold_multiply(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = fold_multiply(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = fold_multiply(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    __uint128_t product = (__uint128_t) (a ^ secret[1]) * (b ^ seed);
+    return fold_multiply((uint64_t) product ^ secret[0] ^ length, (uint64_t) (product >> 64) ^ secret[1]);
+}
+
+// Maps the hash to [0, num_partitions_) with its high bits, the tables using the low ones
+unsigned long reduce_hash(unsigned long hash, int num_partitions_) {
+    return (unsigned long) (((__uint128_t) hash * (unsigned long) num_partitions_) >> 64);
+}
+
+// djb2 hash of the key, used by the partitioner of the previous versions
+unsigned long djb2_hash(const char* key) {
+    unsigned long hash = 5381;
+    unsigned char c;
+    while ((c = *key++) != '\0') {
+        hash = hash * 33 + c;
+    }
+    return hash;
+}
+
+// Monotonic time in seconds
+double wall_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Locks the partition, the time spent waiting is only measured when another thread holds the lock
+void lock_partition(partition_t* partition) {
+    if (pthread_mutex_trylock(&partition->lock) == 0) {
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&partition->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long waited = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    __atomic_add_fetch(&context_->lock_wait, waited, __ATOMIC_RELAXED);
+}
+
+// Bytes arena_alloc takes for size bytes
+size_t aligned_size(size_t size) {
+    return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+// Returns size bytes from the arena, aligned for any node
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = aligned_size(size);
+    chunk_t* chunk = arena->head;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > CHUNK_SIZE / 4 ? size : CHUNK_SIZE;  // Large requests get their own chunk
+        chunk = NULL;
+        // Left by a previous run or a freed arena, checked without the lock first. Their pages are already
+        //   allocated, so arenas placed on a node don't take them.
+        if (chunk_size == CHUNK_SIZE && arena->node < 0 && __atomic_load_n(&context_->free_chunks, __ATOMIC_RELAXED)) {
+            pthread_mutex_lock(&context_->arenas_lock);
+            chunk = context_->free_chunks;
+            if (chunk) {
+                __atomic_store_n(&context_->free_chunks, chunk->next, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&context_->arenas_lock);
+        }
+        if (!chunk) {
+            chunk = malloc(sizeof(chunk_t) + chunk_size);
+            assert(chunk);
+            place_on_node(chunk, sizeof(chunk_t) + chunk_size, arena->node);
+            __atomic_add_fetch(&context_->bytes_allocated, sizeof(chunk_t) + chunk_size, __ATOMIC_RELAXED);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->last_value = NULL;
+        arena->size += sizeof(chunk_t) + chunk_size;
+        if (arena->head && chunk_size != CHUNK_SIZE) {  // Keep filling the current chunk afterwards
+            chunk->next = arena->head->next;
+            arena->head->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+    }
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+// Gives the arena a chunk of exactly size bytes, which holds allocations adding up to size with aligned_size
+void reserve_arena(arena_t* arena, size_t size) {
+    chunk_t* chunk = malloc(sizeof(chunk_t) + size);
+    assert(chunk);
+    place_on_node(chunk, sizeof(chunk_t) + size, arena->node);
+    __atomic_add_fetch(&context_->bytes_allocated, sizeof(chunk_t) + size, __ATOMIC_RELAXED);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->last_value = NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->size += sizeof(chunk_t) + size;
+}
+
+// Copies length bytes of str in the arena, followed by a NUL
+char* arena_strndup(arena_t* arena, const char* str, size_t length) {
+    char* copy = arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Copies the value in the arena, NUL terminated, preceded by its length with binary_values
+char* copy_value(arena_t* arena, const char* value, size_t length) {
+    if (!context_->binary_values) {
+        return arena_strndup(arena, value, length);
+    }
+    assert(length <= UINT32_MAX);
+    uint32_t stored_length = (uint32_t) length;
+    char* copy = arena_alloc(arena, sizeof(stored_length) + length + 1);
+    memcpy(copy, &stored_length, sizeof(stored_length));
+    memcpy(copy + sizeof(stored_length), value, length);
+    copy[sizeof(stored_length) + length] = '\0';
+    return copy + sizeof(stored_length);
+}
+
+// Length of a value copied by copy_value, values of the hash shuffle have no other
+size_t value_length(const char* value) {
+    if (!context_->binary_values) {
+        return strlen(value);
+    }
+    uint32_t stored_length;
+    memcpy(&stored_length, value - sizeof(stored_length), sizeof(stored_length));
+    return stored_length;
+}
+
+char* MR_CombinedBytes(const void* value, size_t length) {
+    assert(length <= UINT32_MAX);
+    uint32_t stored_length = (uint32_t) length;
+    char* copy = malloc(sizeof(stored_length) + length + 1);
+    assert(copy);
+    memcpy(copy, &stored_length, sizeof(stored_length));
+    memcpy(copy + sizeof(stored_length), value, length);
+    copy[sizeof(stored_length) + length] = '\0';
+    combined_bytes_ = copy + sizeof(stored_length);
+    return combined_bytes_;
+}
+
+// Value returned by a Combiner from a malloc'd string, or with binary_values from MR_CombinedBytes
+char* combined_value(const char* value, size_t length) {
+    if (context_->binary_values) {
+        return MR_CombinedBytes(value, length);
+    }
+    char* copy = strndup(value, length);
+    assert(copy);
+    return copy;
+}
+
+// Length of what a Combiner returned, a plain malloc'd string unless MR_CombinedBytes made it
+size_t combined_length(const char* combined) {
+    if (combined != combined_bytes_) {
+        return strlen(combined);
+    }
+    uint32_t stored_length;
+    memcpy(&stored_length, combined - sizeof(stored_length), sizeof(stored_length));
+    return stored_length;
+}
+
+// Frees what a Combiner returned
+void free_combined(char* combined) {
+    if (combined == combined_bytes_) {
+        free(combined - sizeof(uint32_t));
+        combined_bytes_ = NULL;
+    } else {
+        free(combined);
+    }
+}
+
+// Copies the value in the arena, with compress_values a value equal to the last one copied in the current chunk
+//   shares its copy instead (values are never written to).
+char* arena_value(arena_t* arena, const char* value, size_t length) {
+    chunk_t* chunk = arena->head;
+    if (!context_->compress_values) {
+        return copy_value(arena, value, length);
+    }
+    if (chunk && chunk->last_value && chunk->last_value_length == length && memcmp(chunk->last_value, value, length) == 0) {
+        return chunk->last_value;
+    }
+    char* copy = copy_value(arena, value, length);
+    if (length < CHUNK_SIZE / 4) {  // Otherwise the copy has a chunk of its own, which isn't the head
+        arena->head->last_value = copy;
+        arena->head->last_value_length = length;
+    }
+    return copy;
+}
+
+// Gives the chunks of CHUNK_SIZE bytes back to the context for its arenas, the others are freed
+void free_arena(arena_t* arena) {
+    chunk_t* chunk = arena->head;
+    chunk_t* reused = NULL;
+    chunk_t* last_reused = NULL;
+    while (chunk) {
+        chunk_t* tmp_chunk = chunk;
+        chunk = chunk->next;
+        if (tmp_chunk->size == CHUNK_SIZE) {
+            tmp_chunk->next = reused;
+            reused = tmp_chunk;
+            last_reused = last_reused ? last_reused : tmp_chunk;
+        } else {
+            free(tmp_chunk);
+        }
+    }
+    if (reused) {  // One lock for the whole arena
+        pthread_mutex_lock(&context_->arenas_lock);
+        last_reused->next = context_->free_chunks;
+        __atomic_store_n(&context_->free_chunks, reused, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&context_->arenas_lock);
+    }
+    arena->head = NULL;
+    arena->size = 0;
+}
+
+// Creates an arena freed with the partitions
+arena_t* register_arena() {
+    arena_t* arena = calloc(1, sizeof(arena_t));
+    assert(arena);
+    arena->node = -1;
+    pthread_mutex_lock(&context_->arenas_lock);
+    arena->next = context_->arenas;
+    context_->arenas = arena;
+    pthread_mutex_unlock(&context_->arenas_lock);
+    return arena;
+}
+
+// Helper function to initialize an empty table
+void init_table(table_t* table) {
+    table->capacity = INITIAL_CAPACITY;
+    table->count = 0;
+    table->node = -1;
+    table->slots = calloc(table->capacity, sizeof(slot_t));
+    __atomic_add_fetch(&context_->bytes_allocated, table->capacity * sizeof(slot_t), __ATOMIC_RELAXED);
+    assert(table->slots);  // Ensure memory allocation was successful
+}
+
+// Helper function to initialize an empty buffer for the shuffle in use
+void init_buffer(buffer_t* buffer) {
+    if (context_->shuffle == MR_SHUFFLE_HASH) {
+        init_table(&buffer->table);
+    } else {
+        buffer->table.slots = NULL;
+    }
+    buffer->records = NULL;
+    buffer->arena.head = NULL;
+    buffer->arena.size = 0;
+    buffer->arena.node = -1;
+    buffer->capacity = 0;
+    buffer->num_emits = 0;
+    buffer->num_hot = 0;
+    buffer->remote = 0;
+}
+
+// Helper function to generate a new entry node
+entry_t* generate_entry(arena_t* arena, const char* key, size_t key_length, unsigned long hash) {
+    entry_t* entry_node = arena_alloc(arena, sizeof(entry_t));
+    entry_node->key = arena_strndup(arena, key, key_length);
+    entry_node->key_length = key_length;
+    entry_node->hash = hash;
+    entry_node->head = NULL;
+    return entry_node;
+}
+
+// Doubles the capacity of the table, entries are moved using their stored hash
+void grow_table(table_t* table) {
+    unsigned long capacity = table->capacity * 2;
+    slot_t* slots = calloc(capacity, sizeof(slot_t));
+    assert(slots);
+    place_on_node(slots, capacity * sizeof(slot_t), table->node);
+    __atomic_add_fetch(&context_->bytes_allocated, capacity * sizeof(slot_t), __ATOMIC_RELAXED);
+    for (unsigned long i = 0; i < table->capacity; i++) {
+        slot_t* slot = &table->slots[i];
+        if (slot->entry) {
+            unsigned long j = slot->hash & (capacity - 1);
+            while (slots[j].entry) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = *slot;
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+// Returns the slot holding the key, or the empty slot where it should be inserted
+slot_t* find_slot(table_t* table, const char* key, size_t key_length, unsigned long hash) {
+    unsigned long mask = table->capacity - 1;
+    unsigned long i = hash & mask;
+    while (table->slots[i].entry) {
+        slot_t* slot = &table->slots[i];
+        if (slot->hash == hash && slot->entry->key_length == key_length
+            && memcmp(slot->entry->key, key, key_length) == 0) {  // Found an entry
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+// Stores the entry in the empty slot returned by find_slot
+void insert_entry(table_t* table, slot_t* slot, entry_t* entry) {
+    slot->hash = entry->hash;
+    slot->entry = entry;
+    if (++table->count * 4 > table->capacity * 3) {  // Keep the load factor under 3/4
+        grow_table(table);
+    }
+}
+
+// Function to get an entry or create a new one for the given key, hash being its mixed hash
+entry_t* get_entry(table_t* table, arena_t* arena, const char* key, size_t key_length, unsigned long hash) {
+    slot_t* slot = find_slot(table, key, key_length, hash);
+    if (slot->entry) {
+        return slot->entry;
+    }
+
+    // If key not found, create a new entry in the empty slot
+    entry_t* entry_node = generate_entry(arena, key, key_length, hash);
+    insert_entry(table, slot, entry_node);
+    return entry_node;
+}
+
+// Appends a copy of the value to the first node of the entry's list, preceded by a bigger node once it is full
+void add_value(entry_t* entry, arena_t* arena, const char* value, size_t value_length) {
+    values_t* head = entry->head;
+    if (!head || head->count == head->capacity) {
+        int capacity = !head ? MIN_VALUES : head->capacity < MAX_VALUES ? head->capacity * 2 : MAX_VALUES;
+        values_t* node = arena_alloc(arena, sizeof(values_t) + capacity * sizeof(char*));
+        node->next = head;  // Insert at the beginning of the Level 2 list
+        node->count = 0;
+        node->capacity = capacity;
+        entry->head = head = node;
+    }
+    head->values[head->count++] = arena_value(arena, value, value_length);  // Copy the value
+}
+
+char* get_next(char* key, int partition_number);
+
+// Replaces the values of the entry by the result of the combiner, kept in the arena
+void combine_entry(entry_t* entry, arena_t* arena, int partition_number) {
+    if (entry->head && (entry->head->count > 1 || entry->head->next)) {  // Nothing to gain with a single value
+        current_entry_ = entry;
+        char* combined = context_->combiner(entry->key, (Getter)get_next, partition_number);
+        current_entry_ = NULL;
+        if (combined) {
+            add_value(entry, arena, combined, combined_length(combined));
+            free_combined(combined);
+        }
+    }
+}
+
+// Called when a node of the buffered entry is full: a key holding a big share of the batch is hot, its values are then
+//   combined right away, or without a combiner those of its full nodes are held past the batch (merging an entry
+//   costs the same whatever its values), so that its partition isn't flushed and locked more often than the others.
+void check_hot_key(buffer_t* buffer, entry_t* entry, arena_t* arena, int partition_number) {
+    int count = 0;
+    for (values_t* node = entry->head; node; node = node->next) {
+        count += node->count;
+    }
+    if (count * HOT_KEY_SHARE < context_->batch_size) {
+        return;
+    }
+    __atomic_add_fetch(&context_->hot_keys, 1, __ATOMIC_RELAXED);
+    if (!context_->combiner) {
+        buffer->num_hot += entry->head->count;
+        return;
+    }
+    combine_entry(entry, arena, partition_number);
+    for (values_t* node = entry->head; node; node = node->next) {
+        count -= node->count;
+    }
+    buffer->num_hot += count;
+}
+
+// Replaces the values buffered for every key by the result of the combiner, returns the number of values left
+int combine_buffer(buffer_t* buffer, int partition_number) {
+    table_t* local = &buffer->table;
+    int num_values = 0;
+    for (unsigned long i = 0; i < local->capacity; i++) {
+        entry_t* entry = local->slots[i].entry;
+        if (entry) {
+            combine_entry(entry, buffer->remote ? &buffer->arena : arena_, partition_number);
+            for (values_t* node = entry->head; node; node = node->next) {
+                num_values += node->count;
+            }
+        }
+    }
+    return num_values;
+}
+
+// Moves the entry in the table, or its values in front of those of the entry with the same key,
+//   returns the entry of the table holding the values or NULL if there were none.
+entry_t* merge_entry(table_t* table, entry_t* entry) {
+    slot_t* slot = find_slot(table, entry->key, entry->key_length, entry->hash);
+    if (!slot->entry || !entry->head) {
+        if (!slot->entry) {
+            insert_entry(table, slot, entry);
+            return entry;
+        }
+        return NULL;  // The combiner consumed every value without returning any
+    }
+    values_t* tail = entry->head;
+    while (tail->next) {
+        tail = tail->next;
+    }
+    tail->next = slot->entry->head;  // The local nodes go first, the one being filled is then the local head
+    slot->entry->head = entry->head;  // The local entry stays in the arena until the end of the run
+    return slot->entry;
+}
+
+// Appends a copy of the pair to the buffer's records, strings go in the buffer's arena
+void add_record(buffer_t* buffer, const char* key, size_t key_length, const char* value, size_t value_length) {
+    if (buffer->num_emits == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : (context_->batch_size > 1 ? context_->batch_size : INITIAL_CAPACITY);
+        buffer->records = realloc(buffer->records, buffer->capacity * sizeof(record_t));
+        __atomic_add_fetch(&context_->bytes_allocated, buffer->capacity * sizeof(record_t), __ATOMIC_RELAXED);
+        assert(buffer->records);
+    }
+    record_t* record = &buffer->records[buffer->num_emits++];
+    record->key = arena_strndup(&buffer->arena, key, key_length);
+    record->key_length = key_length;
+    record->value = arena_value(&buffer->arena, value, value_length);
+    record->value_length = value_length;
+}
+
+// Byte order of the keys, a key sorts before the keys it is a prefix of
+int compare_records(const record_t* a, const record_t* b) {
+    size_t length = a->key_length < b->key_length ? a->key_length : b->key_length;
+    int cmp = memcmp(a->key, b->key, length);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a->key_length > b->key_length) - (a->key_length < b->key_length);
+}
+
+// Byte of the key at depth, shifted by one so that the end of the key sorts first
+int key_byte(const record_t* record, size_t depth) {
+    return depth < record->key_length ? (unsigned char) record->key[depth] + 1 : 0;
+}
+
+void swap_records(record_t* a, record_t* b) {
+    record_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Multikey quicksort of records whose keys share their first depth bytes
+void sort_records(record_t* records, size_t count, size_t depth) {
+    while (count > 16) {
+        swap_records(&records[0], &records[count / 2]);
+        int pivot = key_byte(&records[0], depth);
+        size_t lt = 0, i = 1, gt = count;  // [0, lt) < pivot, [lt, i) == pivot, [gt, count) > pivot
+        while (i < gt) {
+            int byte = key_byte(&records[i], depth);
+            if (byte < pivot) {
+                swap_records(&records[lt++], &records[i++]);
+            } else if (byte > pivot) {
+                swap_records(&records[i], &records[--gt]);
+            } else {
+                i++;
+            }
+        }
+        sort_records(records, lt, depth);
+        sort_records(records + gt, count - gt, depth);
+        if (pivot == 0) {  // The middle keys all ended, they are equal
+            return;
+        }
+        records += lt;  // Sort the middle on the next byte without recursing
+        count = gt - lt;
+        depth++;
+    }
+    for (size_t i = 1; i < count; i++) {  // Insertion sort for the small ranges
+        for (size_t j = i; j > 0 && compare_records(&records[j - 1], &records[j]) > 0; j--) {
+            swap_records(&records[j - 1], &records[j]);
+        }
+    }
+}
+
+// Makes room for length bytes and a NUL in the buffer, keeping its content
+void reserve_buffer(char** buffer, size_t* capacity, size_t length) {
+    if (length + 1 > *capacity) {
+        *capacity = length + 1 > 2 * *capacity ? length + 1 : 2 * *capacity;
+        *buffer = realloc(*buffer, *capacity);
+        assert(*buffer);
+    }
+}
+
+// Reads length bytes of the spill file in the buffer from offset, growing it and NUL terminating it
+void read_spilled(FILE* file, char** buffer, size_t* capacity, size_t offset, size_t length) {
+    reserve_buffer(buffer, capacity, offset + length);
+    size_t n = fread(*buffer + offset, 1, length, file);
+    assert(n == length);  // Spill files are only read back by the process that wrote them
+    (*buffer)[offset + length] = '\0';
+}
+
+// LEB128, 7 bits per byte with the high bit set on all but the last byte
+void write_varint(FILE* file, size_t n) {
+    while (n >= 0x80) {
+        putc_unlocked((int) (n & 0x7f) | 0x80, file);
+        n >>= 7;
+    }
+    putc_unlocked((int) n, file);
+}
+
+size_t read_varint(FILE* file) {
+    size_t n = 0;
+    int shift = 0, c;
+    do {
+        c = getc_unlocked(file);
+        assert(c != EOF);
+        n |= (size_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return n;
+}
+
+// Writes sorted records to a spill file. A record is the length of the prefix its key shares with the previous key,
+//   the length of the rest of the key, 0 if the value is the previous value or else its length + 1, then the bytes.
+typedef struct spill_writer {
+    FILE* file;
+    char* key;  // Previous record, copied since the records read from spill files are overwritten
+    size_t key_length;
+    size_t key_capacity;
+    char* value;  // NULL before the first record
+    size_t value_length;
+    size_t value_capacity;
+} spill_writer_t;
+
+void write_spilled(spill_writer_t* writer, record_t* record) {
+    size_t shared = 0;
+    size_t length = record->key_length < writer->key_length ? record->key_length : writer->key_length;
+    while (shared < length && record->key[shared] == writer->key[shared]) {
+        shared++;
+    }
+    int same_value = writer->value && record->value_length == writer->value_length
+        && memcmp(record->value, writer->value, record->value_length) == 0;
+    write_varint(writer->file, shared);
+    write_varint(writer->file, record->key_length - shared);
+    write_varint(writer->file, same_value ? 0 : record->value_length + 1);
+    fwrite(record->key + shared, 1, record->key_length - shared, writer->file);
+    reserve_buffer(&writer->key, &writer->key_capacity, record->key_length);
+    memcpy(writer->key + shared, record->key + shared, record->key_length - shared);
+    writer->key_length = record->key_length;
+    if (!same_value) {
+        fwrite(record->value, 1, record->value_length, writer->file);
+        reserve_buffer(&writer->value, &writer->value_capacity, record->value_length);
+        memcpy(writer->value, record->value, record->value_length);
+        writer->value_length = record->value_length;
+    }
+}
+
+// Moves to the next record of the run, returns 0 once the run is exhausted
+int advance_cursor(run_cursor_t* cursor) {
+    if (--cursor->remaining == 0) {
+        return 0;
+    }
+    if (!cursor->file) {
+        cursor->next++;
+        return 1;
+    }
+    record_t* record = &cursor->current;  // Still holds the previous key and value, see write_spilled
+    size_t shared = read_varint(cursor->file);
+    size_t suffix_length = read_varint(cursor->file);
+    size_t value_tag = read_varint(cursor->file);
+    read_spilled(cursor->file, &record->key, &cursor->key_capacity, shared, suffix_length);
+    record->key_length = shared + suffix_length;
+    if (value_tag > 0) {
+        record->value_length = value_tag - 1;
+        read_spilled(cursor->file, &record->value, &cursor->value_capacity, 0, record->value_length);
+    }
+    return 1;
+}
+
+// Points the cursor to its first record, the run must not be empty
+void open_cursor(run_cursor_t* cursor, run_t* run) {
+    cursor->remaining = run->count;
+    cursor->file = run->file;
+    if (run->file) {
+        cursor->key_capacity = 0;
+        cursor->value_capacity = 0;
+        cursor->current.key = NULL;
+        cursor->current.key_length = 0;
+        cursor->current.value = NULL;
+        cursor->current.value_length = 0;
+        rewind(run->file);
+        cursor->next = &cursor->current;
+        cursor->remaining++;  // Reading the first record counts as an advance
+        advance_cursor(cursor);
+    } else {
+        cursor->next = run->records;
+    }
+}
+
+void close_cursor(run_cursor_t* cursor) {
+    if (cursor->file) {
+        free(cursor->current.key);
+        free(cursor->current.value);
+    }
+}
+
+// Restores the heap order from position i down
+void sift_down(merge_t* merge, int i) {
+    run_cursor_t** heap = merge->heap;
+    while (1) {
+        int smallest = i, left = 2 * i + 1, right = left + 1;
+        if (left < merge->size && compare_records(heap[left]->next, heap[smallest]->next) < 0) {
+            smallest = left;
+        }
+        if (right < merge->size && compare_records(heap[right]->next, heap[smallest]->next) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        run_cursor_t* tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Sets up the merge of the given cursors, which must all point to a record
+void init_merge(merge_t* merge, run_cursor_t** heap, int size) {
+    merge->heap = heap;
+    merge->size = size;
+    merge->key = NULL;
+    merge->key_length = 0;
+    merge->key_capacity = 0;
+    merge->values.head = NULL;
+    merge->values.size = 0;
+    merge->values.node = -1;
+    for (int i = size / 2 - 1; i >= 0; i--) {
+        sift_down(merge, i);
+    }
+}
+
+void free_merge(merge_t* merge) {
+    free(merge->key);
+    free_arena(&merge->values);
+}
+
+// Moves past the smallest record
+void advance_merge(merge_t* merge) {
+    if (!advance_cursor(merge->heap[0])) {  // Run exhausted
+        merge->heap[0] = merge->heap[--merge->size];
+    }
+    sift_down(merge, 0);
+}
+
+// Returns the next record with the key being read, or NULL once its values are exhausted
+record_t* next_merged_record(merge_t* merge) {
+    if (merge->size == 0 || !merge->key) {  // No key is being read before the first next_merged_key
+        return NULL;
+    }
+    run_cursor_t* top = merge->heap[0];
+    record_t* record = top->next;
+    if (record->key_length != merge->key_length || memcmp(record->key, merge->key, merge->key_length) != 0) {
+        return NULL;
+    }
+    if (top->file) {  // The cursor's buffers are reused by the next record, keep the value until the next key
+        merge->current.key = merge->key;
+        merge->current.key_length = merge->key_length;
+        merge->current.value = arena_strndup(&merge->values, record->value, record->value_length);
+        merge->current.value_length = record->value_length;
+        record = &merge->current;
+    }
+    advance_merge(merge);
+    return record;
+}
+
+// Moves to the smallest key that wasn't read yet, returns 0 once the merge is over
+int next_merged_key(merge_t* merge) {
+    while (next_merged_record(merge)) {  // Values the last reader left
+    }
+    free_arena(&merge->values);
+    if (merge->size == 0) {
+        return 0;
+    }
+    record_t* first = merge->heap[0]->next;
+    if (first->key_length + 1 > merge->key_capacity) {  // The key is copied since spilled records are overwritten
+        merge->key_capacity = 2 * (first->key_length + 1);
+        free(merge->key);
+        merge->key = malloc(merge->key_capacity);
+        assert(merge->key);
+    }
+    memcpy(merge->key, first->key, first->key_length + 1);
+    merge->key_length = first->key_length;
+    return 1;
+}
+
+// Bytes of memory held by the run
+size_t run_memory(run_t* run) {
+    return run->file ? 0 : run->arena.size + run->count * sizeof(record_t);
+}
+
+// Replaces the records of every key of the sorted run by the result of the combiner
+void combine_run(run_t* run, int partition_number) {
+    record_t* records = malloc(run->count * sizeof(record_t));
+    assert(records);
+    size_t count = 0;
+    run_cursor_t cursor;
+    run_cursor_t* heap = &cursor;
+    open_cursor(&cursor, run);
+    merge_t merge;
+    init_merge(&merge, &heap, 1);
+    current_merge_ = &merge;
+    while (next_merged_key(&merge)) {
+        record_t* first = cursor.next;
+        if (cursor.remaining == 1 || compare_records(first, first + 1) != 0) {  // Nothing to gain with a single value
+            records[count++] = *first;
+            advance_merge(&merge);
+            continue;
+        }
+        char* combined = context_->combiner(merge.key, (Getter)get_next, partition_number);
+        record_t* left;
+        while ((left = next_merged_record(&merge))) {  // Keep the values the combiner didn't read
+            records[count++] = *left;
+        }
+        if (combined) {
+            records[count].key = first->key;
+            records[count].key_length = first->key_length;
+            records[count].value_length = combined_length(combined);
+            records[count].value = arena_value(&run->arena, combined, records[count].value_length);
+            count++;
+            free_combined(combined);
+        }
+    }
+    current_merge_ = NULL;
+    free_merge(&merge);
+    free(run->records);
+    run->records = realloc(records, (count + 1) * sizeof(record_t));  // Held for as long as the run
+    assert(run->records);
+    __atomic_add_fetch(&context_->bytes_allocated, (count + 1) * sizeof(record_t), __ATOMIC_RELAXED);
+    run->count = count;
+}
+
+// Copies the strings of the sorted run in a chunk of their size, records of the same key sharing one copy of it, the
+//   chunks the buffer filled go back to the context for the next batches. They hold a whole CHUNK_SIZE even for a
+//   few records, which the memory limit would otherwise count for every run.
+void compact_run(run_t* run) {
+    size_t header = context_->binary_values ? sizeof(uint32_t) : 0;
+    size_t size = 0;
+    for (size_t i = 0; i < run->count; i++) {
+        record_t* record = &run->records[i];
+        if (i == 0 || compare_records(record - 1, record) != 0) {
+            size += aligned_size(record->key_length + 1);
+        }
+        size += aligned_size(header + record->value_length + 1);
+    }
+    arena_t arena = {NULL, 0, run->arena.node, NULL};
+    if (size > 0) {
+        reserve_arena(&arena, size);
+    }
+    for (size_t i = 0; i < run->count; i++) {
+        record_t* record = &run->records[i];
+        if (i == 0 || compare_records(record - 1, record) != 0) {  // The previous key is already copied
+            record->key = arena_strndup(&arena, record->key, record->key_length);
+        } else {
+            record->key = record[-1].key;
+        }
+        record->value = arena_value(&arena, record->value, record->value_length);
+    }
+    free_arena(&run->arena);
+    run->arena = arena;
+}
+
+// Turns the buffered records into a sorted run, the buffer is left empty
+run_t* seal_run(buffer_t* buffer, int partition_number) {
+    run_t* run = malloc(sizeof(run_t));
+    assert(run);
+    run->records = buffer->records;
+    run->count = buffer->num_emits;
+    run->arena = buffer->arena;  // The strings move with the records
+    run->file = NULL;
+    run->next = NULL;
+    buffer->records = NULL;
+    buffer->capacity = 0;
+    buffer->num_emits = 0;
+    buffer->arena.head = NULL;
+    buffer->arena.size = 0;
+
+    sort_records(run->records, run->count, 0);
+    if (context_->combiner) {
+        combine_run(run, partition_number);
+    }
+    compact_run(run);
+    return run;
+}
+
+// Opens an anonymous spill file in the spill directory
+int create_temp_file() {
+    const char* directory = context_->spill_directory ? context_->spill_directory : getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/mapreduce-XXXXXX", directory ? directory : "/tmp");
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);  // Removed as soon as it is closed
+    return fd;
+}
+
+FILE* open_spill_file() {
+    FILE* file = fdopen(create_temp_file(), "w+");
+    assert(file);
+    return file;
+}
+
+// Merges the runs of the partition held in memory into one sorted run written to a spill file,
+//   its spill files are merged as well once there are too many of them.
+void spill_partition(int partition_number) {
+    partition_t* partition = &context_->partitions[partition_number];
+    run_t* spilled = NULL;
+    lock_partition(partition);  // Take the runs in memory, other mappers can keep pushing
+    int num_files = 0;
+    for (run_t* run = partition->runs; run; run = run->next) {
+        num_files += run->file != NULL;
+    }
+    run_t** link = &partition->runs;
+    while (*link) {
+        run_t* run = *link;
+        if ((!run->file || num_files >= MAX_SPILL_FILES) && run->count > 0) {
+            *link = run->next;
+            run->next = spilled;
+            spilled = run;
+        } else {
+            link = &run->next;
+        }
+    }
+    __atomic_store_n(&partition->memory, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&partition->lock);
+    if (!spilled) {
+        return;
+    }
+
+    int num_runs = 0;
+    size_t memory = 0;
+    for (run_t* run = spilled; run; run = run->next) {
+        num_runs++;
+    }
+    run_cursor_t* cursors = malloc(num_runs * sizeof(run_cursor_t));
+    run_cursor_t** heap = malloc(num_runs * sizeof(run_cursor_t*));
+    assert(cursors && heap);
+    int i = 0;
+    for (run_t* run = spilled; run; run = run->next, i++) {
+        open_cursor(&cursors[i], run);
+        heap[i] = &cursors[i];
+    }
+
+    run_t* file_run = malloc(sizeof(run_t));
+    assert(file_run);
+    file_run->records = NULL;
+    file_run->count = 0;
+    file_run->arena.head = NULL;
+    file_run->arena.size = 0;
+    file_run->arena.node = -1;
+    file_run->file = open_spill_file();
+    spill_writer_t writer = {file_run->file, NULL, 0, 0, NULL, 0, 0};
+    merge_t merge;
+    init_merge(&merge, heap, num_runs);
+    while (merge.size > 0) {
+        write_spilled(&writer, heap[0]->next);
+        file_run->count++;
+        advance_merge(&merge);
+    }
+    int flushed = fflush(file_run->file);
+    assert(flushed == 0);  // Out of disk space
+    free(writer.key);
+    free(writer.value);
+    free_merge(&merge);
+    for (i = 0; i < num_runs; i++) {
+        close_cursor(&cursors[i]);
+    }
+    free(heap);
+    free(cursors);
+
+    while (spilled) {
+        run_t* run = spilled;
+        spilled = run->next;
+        memory += run_memory(run);
+        free(run->records);
+        free_arena(&run->arena);
+        if (run->file) {
+            fclose(run->file);
+        }
+        free(run);
+    }
+    __atomic_sub_fetch(&context_->memory_used, memory, __ATOMIC_RELAXED);
+
+    lock_partition(partition);
+    file_run->next = partition->runs;
+    partition->runs = file_run;
+    pthread_mutex_unlock(&partition->lock);
+}
+
+// Adds the run to the partition, spilling the biggest partition if the runs in memory exceed the limit
+void push_run(int partition_number, run_t* run) {
+    partition_t* partition = &context_->partitions[partition_number];
+    size_t memory = run_memory(run);
+    lock_partition(partition);
+    run->next = partition->runs;
+    partition->runs = run;
+    partition->size += run->count;
+    __atomic_add_fetch(&partition->memory, memory, __ATOMIC_RELAXED);  // Also read by spilling mappers
+    pthread_mutex_unlock(&partition->lock);
+
+    size_t memory_used = __atomic_add_fetch(&context_->memory_used, memory, __ATOMIC_RELAXED);
+    if (context_->memory_limit > 0 && memory_used > context_->memory_limit) {
+        int biggest = 0;
+        size_t biggest_memory = 0;
+        for (int i = 0; i < context_->num_partitions; i++) {  // Unlocked read, any big partition will do
+            size_t partition_memory = __atomic_load_n(&context_->partitions[i].memory, __ATOMIC_RELAXED);
+            if (partition_memory > biggest_memory) {
+                biggest = i;
+                biggest_memory = partition_memory;
+            }
+        }
+        spill_partition(biggest);
+    }
+}
+
+void send_buffer(buffer_t* buffer, int partition_number);
+
+// Moves the buffered entries in the shared partition, new keys are moved as they are,
+//   the values of known keys are put in front of the existing ones.
+void flush_buffer(buffer_t* buffer, int partition_number) {
+    partition_t* partition = &context_->partitions[partition_number];
+    table_t* local = &buffer->table;
+    if (buffer->remote) {
+        send_buffer(buffer, partition_number);
+        return;
+    }
+
+    if (context_->shuffle == MR_SHUFFLE_SORT) {
+        push_run(partition_number, seal_run(buffer, partition_number));
+        return;
+    }
+
+    if (context_->combiner) {  // Combine outside of the lock, the partition's size counts the values left
+        buffer->num_emits = combine_buffer(buffer, partition_number);
+    }
+
+    if (context_->pipeline) {  // The reducer merges the whole table, the mapper starts a new one
+        inbox_t* inbox = &context_->inboxes[partition_number % context_->num_reducers];
+        batch_t* batch = malloc(sizeof(batch_t));
+        assert(batch);
+        batch->table = *local;
+        batch->partition_number = partition_number;
+        batch->num_emits = buffer->num_emits;
+        init_table(local);
+        buffer->num_emits = 0;
+        buffer->num_hot = 0;
+        pthread_mutex_lock(&inbox->lock);
+        batch->next = inbox->batches;
+        inbox->batches = batch;
+        pthread_cond_signal(&inbox->ready);
+        pthread_mutex_unlock(&inbox->lock);
+        return;
+    }
+
+    lock_partition(partition);
+    partition->size += buffer->num_emits;
+    for (unsigned long i = 0; i < local->capacity; i++) {
+        entry_t* entry = local->slots[i].entry;
+        if (entry) {
+            merge_entry(&partition->table, entry);
+        }
+    }
+    pthread_mutex_unlock(&partition->lock);
+
+    memset(local->slots, 0, local->capacity * sizeof(slot_t));
+    local->count = 0;
+    buffer->num_emits = 0;
+    buffer->num_hot = 0;
+}
+
+
+
+// Entry of the key for the Getters, the one being reduced unless another key is asked for
+entry_t* reduced_entry(char* key, int partition_number) {
+    entry_t* entry = current_entry_;
+    if (!entry || (entry->key != key && strcmp(entry->key, key) != 0)) {  // Not the key being reduced, look it up
+        table_t* table = &context_->partitions[partition_number].table;
+        size_t key_length = strlen(key);
+        entry = find_slot(table, key, key_length, hash_key(key, key_length))->entry;
+    }
+    return entry;
+}
+
+char* get_next(char* key, int partition_number) {
+    if (current_merge_) {  // Sort shuffle, only the values of the key being read are at hand
+        record_t* record = next_merged_record(current_merge_);
+        if (!record) {
+            return NULL;
+        }
+        return context_->borrow_values ? record->value : strdup(record->value);
+    }
+
+    entry_t* entry = reduced_entry(key, partition_number);
+    if (entry) {
+        values_t *value_head = entry->head;
+        if (value_head) {
+            char* value = value_head->values[--value_head->count];
+            if (value_head->count == 0) {
+                entry->head = value_head->next;  // The node itself is released with the arena
+            }
+            if (context_->borrow_values) {
+                return value;
+            }
+            return strdup(value); //Will be freed after usage in Reduce
+        }
+    }
+    return NULL;
+}
+
+int MR_GetBytes(char* key, int partition_number, const void** value, size_t* length) {
+    if (current_merge_) {
+        record_t* record = next_merged_record(current_merge_);
+        if (!record) {
+            return 0;
+        }
+        *value = record->value;
+        *length = record->value_length;
+        return 1;
+    }
+
+    entry_t* entry = reduced_entry(key, partition_number);
+    if (!entry || !entry->head) {
+        return 0;
+    }
+    values_t* value_head = entry->head;
+    char* next = value_head->values[--value_head->count];
+    if (value_head->count == 0) {
+        entry->head = value_head->next;
+    }
+    *value = next;
+    *length = value_length(next);
+    return 1;
+}
+
+size_t MR_KeyLength(char* key) {
+    if (current_merge_ && key == current_merge_->key) {
+        return current_merge_->key_length;
+    }
+    if (current_entry_ && key == current_entry_->key) {
+        return current_entry_->key_length;
+    }
+    return strlen(key);
+}
+
+size_t MR_GetValues(char* key, int partition_number, char*** values) {
+    if (current_merge_) {  // The records are copied in a span since their values aren't next to each other
+        size_t count = 0;
+        record_t* record;
+        while (count < MAX_SPAN && (record = next_merged_record(current_merge_))) {
+            span_[count++] = record->value;
+        }
+        *values = span_;
+        return count;
+    }
+
+    entry_t* entry = reduced_entry(key, partition_number);
+    if (!entry || !entry->head) {
+        return 0;
+    }
+    values_t* value_head = entry->head;  // The values left in the first node, which is then read
+    size_t count = value_head->count;
+    *values = value_head->values;
+    value_head->count = 0;
+    entry->head = value_head->next;
+    return count;
+}
+
+void MR_CountReducer(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    unsigned long count = 0;
+    char** values;
+    size_t num_values;
+    while ((num_values = MR_GetValues(key, partition_number, &values)) > 0) {
+        count += num_values;
+    }
+    char number[24];
+    MR_OutputN(key, MR_KeyLength(key), number, snprintf(number, sizeof(number), "%lu", count));
+}
+
+// Sum of the key's values read as integers
+long long sum_values(char* key, int partition_number) {
+    long long sum = 0;
+    char** values;
+    size_t num_values;
+    while ((num_values = MR_GetValues(key, partition_number, &values)) > 0) {
+        for (size_t i = 0; i < num_values; i++) {
+            sum += strtoll(values[i], NULL, 10);
+        }
+    }
+    return sum;
+}
+
+void MR_SumReducer(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    char number[24];
+    MR_OutputN(key, MR_KeyLength(key), number,
+               snprintf(number, sizeof(number), "%lld", sum_values(key, partition_number)));
+}
+
+char* MR_SumCombiner(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    char number[24];
+    return combined_value(number, snprintf(number, sizeof(number), "%lld", sum_values(key, partition_number)));
+}
+
+// Value of the key with the smallest (sign 1) or biggest (sign -1) number, the first one on ties, and its length.
+//   It stays valid until the Reducer returns. With binary_values the values are read with their length.
+const char* extreme_value(char* key, int partition_number, int sign, size_t* length) {
+    const char* best = NULL;
+    double best_number = 0;
+    if (context_->binary_values) {
+        const void* value;
+        size_t value_length;
+        while (MR_GetBytes(key, partition_number, &value, &value_length)) {
+            double number = sign * strtod(value, NULL);  // Values are followed by a NUL byte
+            if (!best || number < best_number) {
+                best = value;
+                best_number = number;
+                *length = value_length;
+            }
+        }
+        return best;
+    }
+    char** values;
+    size_t num_values;
+    while ((num_values = MR_GetValues(key, partition_number, &values)) > 0) {
+        for (size_t i = 0; i < num_values; i++) {
+            double number = sign * strtod(values[i], NULL);
+            if (!best || number < best_number) {
+                best = values[i];
+                best_number = number;
+            }
+        }
+    }
+    if (best) {
+        *length = strlen(best);
+    }
+    return best;
+}
+
+// Outputs the value of the key with the smallest (sign 1) or biggest (sign -1) number
+void output_extreme(char* key, int partition_number, int sign) {
+    size_t length;
+    const char* value = extreme_value(key, partition_number, sign, &length);
+    if (value) {
+        MR_OutputN(key, MR_KeyLength(key), value, length);
+    }
+}
+
+// Combined value of the key, the value with the smallest (sign 1) or biggest (sign -1) number
+char* combine_extreme(char* key, int partition_number, int sign) {
+    size_t length;
+    const char* value = extreme_value(key, partition_number, sign, &length);
+    return value ? combined_value(value, length) : NULL;
+}
+
+void MR_MinReducer(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    output_extreme(key, partition_number, 1);
+}
+
+void MR_MaxReducer(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    output_extreme(key, partition_number, -1);
+}
+
+char* MR_MinCombiner(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    return combine_extreme(key, partition_number, 1);
+}
+
+char* MR_MaxCombiner(char* key, Getter get_next, int partition_number) {
+    (void) get_next;
+    return combine_extreme(key, partition_number, -1);
+}
+
+// Sorts the tasks by decreasing size
+int compare_map_tasks(const void* a, const void* b) {
+    const map_task_t* task_a = a;
+    const map_task_t* task_b = b;
+    return (task_a->length < task_b->length) - (task_a->length > task_b->length);
+}
+
+// Appends a task to the queue, doubling its capacity when needed
+void add_map_task(int* capacity, char* file_name, long offset, long length) {
+    if (context_->num_map_tasks == *capacity) {
+        *capacity *= 2;
+        context_->map_tasks = realloc(context_->map_tasks, *capacity * sizeof(map_task_t));
+        assert(context_->map_tasks);
+    }
+    context_->map_tasks[context_->num_map_tasks].file_name = file_name;
+    context_->map_tasks[context_->num_map_tasks].offset = offset;
+    context_->map_tasks[context_->num_map_tasks].length = length;
+    context_->num_map_tasks++;
+}
+
+// Returns the offset of the first record starting at or after offset, that is right after a newline
+long align_split(int fd, long offset, long size) {
+    char buffer[4096];
+    long position = offset - 1;  // The split starts at offset if the previous byte ends a record
+    ssize_t n;
+    while (position < size && (n = pread(fd, buffer, sizeof(buffer), position)) > 0) {
+        char* newline = memchr(buffer, '\n', n);
+        if (newline) {
+            return position + (newline - buffer) + 1;
+        }
+        position += n;
+    }
+    return size;
+}
+
+// Cuts the file in splits of about split_size bytes ending on a newline
+void split_file(int* capacity, char* file_name, long size, long split_size) {
+    int fd = open(file_name, O_RDONLY);
+    long start = 0;
+    while (fd >= 0 && size - start > split_size) {
+        long end = align_split(fd, start + split_size, size);
+        if (end >= size) {
+            break;
+        }
+        add_map_task(capacity, file_name, start, end - start);
+        start = end;
+    }
+    add_map_task(capacity, file_name, start, size - start);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Builds the sorted queue of files or splits to map
+void init_map_tasks(int argc, char* argv[], long split_size) {
+    int capacity = argc > 1 ? argc - 1 : 1;
+    context_->num_map_tasks = 0;
+    context_->next_map_task = 0;
+    context_->map_tasks = malloc(capacity * sizeof(map_task_t));
+    assert(context_->map_tasks);
+    for (int i = 1; i < argc; i++) {
+        struct stat st;
+        long size = stat(argv[i], &st) == 0 ? (long) st.st_size : -1;
+        if (split_size > 0 && size > split_size) {
+            split_file(&capacity, argv[i], size, split_size);
+        } else {
+            add_map_task(&capacity, argv[i], 0, size);
+        }
+    }
+    qsort(context_->map_tasks, context_->num_map_tasks, sizeof(map_task_t), compare_map_tasks);
+}
+
+// Appends the record to the state, the key must already be in its arena
+void keep_record(stream_state_t* state, char* key, size_t key_length, const char* value, size_t value_length) {
+    if (state->count == state->capacity) {
+        state->capacity = state->capacity ? state->capacity * 2 : INITIAL_CAPACITY;
+        state->records = realloc(state->records, state->capacity * sizeof(record_t));
+        assert(state->records);
+    }
+    record_t* record = &state->records[state->count++];
+    record->key = key;
+    record->key_length = key_length;
+    record->value = arena_value(&state->arena, value, value_length);
+    record->value_length = value_length;
+}
+
+void replay_state(stream_state_t* state, int partition_number) {
+    for (size_t i = 0; i < state->count; i++) {
+        record_t* record = &state->records[i];
+        if (context_->num_replay_states == context_->num_partitions) {  // Partitioned like the previous run
+            MR_EmitPartitioned(partition_number, record->key, record->key_length, record->value, record->value_length);
+        } else {
+            MR_EmitN(record->key, record->key_length, record->value, record->value_length);
+        }
+    }
+}
+
+stream_state_t* create_stream_states(int count) {
+    stream_state_t* states = calloc(count, sizeof(stream_state_t));
+    assert(states);
+    for (int i = 0; i < count; i++) {
+        states[i].arena.node = -1;
+    }
+    return states;
+}
+
+void free_stream_states(stream_state_t* states, int count) {
+    for (int i = 0; i < count; i++) {
+        free(states[i].records);
+        free_arena(&states[i].arena);
+    }
+    free(states);
+}
+
+// Brings the bytes of the task in the page cache, for the mapper that will read it.
+// readahead only starts the reads, file systems that don't support it are read into the buffer.
+void prefetch_task(map_task_t* map_task, char** buffer) {
+    if (map_task->length <= 0) {
+        return;
+    }
+    int fd = open(map_task->file_name, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (readahead(fd, map_task->offset, (size_t) map_task->length) != 0) {
+        if (!*buffer) {
+            *buffer = malloc(PREFETCH_BLOCK);
+            assert(*buffer);
+        }
+        long end = map_task->offset + map_task->length;
+        for (long offset = map_task->offset; offset < end; ) {
+            size_t length = end - offset < PREFETCH_BLOCK ? (size_t) (end - offset) : PREFETCH_BLOCK;
+            ssize_t n = pread(fd, *buffer, length, offset);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                break;  // The mapper will see the error
+            }
+            offset += n > 0 ? n : 0;
+        }
+    }
+    close(fd);
+}
+
+// Prefetch thread, reads the tasks of the queue in order, up to prefetch tasks ahead of the mappers
+void prefetch_(void* argument) {
+    (void) argument;
+    char* buffer = NULL;
+    pthread_mutex_lock(&context_->prefetch_lock);
+    for (int task = 0; task < context_->num_map_tasks && !context_->prefetch_done; task++) {
+        while (!context_->prefetch_done
+               && task >= __atomic_load_n(&context_->next_map_task, __ATOMIC_RELAXED) + context_->prefetch) {
+            pthread_cond_wait(&context_->prefetch_changed, &context_->prefetch_lock);
+        }
+        if (task < __atomic_load_n(&context_->next_map_task, __ATOMIC_RELAXED)) {
+            continue;  // Already being mapped
+        }
+        pthread_mutex_unlock(&context_->prefetch_lock);
+        prefetch_task(&context_->map_tasks[task], &buffer);
+        pthread_mutex_lock(&context_->prefetch_lock);
+    }
+    pthread_mutex_unlock(&context_->prefetch_lock);
+    free(buffer);
+}
+
+// Gives the calling thread the arena and the buffers of a mapper
+void open_buffers() {
+    arena_ = register_arena();
+    buffers_ = malloc(context_->num_partitions * sizeof(buffer_t));
+    assert(buffers_);
+    for (int i = 0; i < context_->num_partitions; i++) {
+        init_buffer(&buffers_[i]);
+        buffers_[i].arena.node = partition_node(i);  // Sorted runs keep the arena of their buffer
+        buffers_[i].remote = task_fd_ >= 0 || (context_->num_nodes > 1 && i % context_->num_nodes != context_->node);
+    }
+}
+
+// Merges what is left in the buffers of the calling thread, or sends it to the process reducing it
+void close_buffers() {
+    for (int i = 0; i < context_->num_partitions; i++) {
+        if (buffers_[i].num_emits > 0) {
+            flush_buffer(&buffers_[i], i);
+        }
+        free(buffers_[i].table.slots);
+        free(buffers_[i].records);
+        free_arena(&buffers_[i].arena);
+    }
+    free(buffers_);
+    buffers_ = NULL;
+    arena_ = NULL;
+    free(frame_);
+    frame_ = NULL;
+    frame_capacity_ = 0;
+    __atomic_add_fetch(&context_->total_emits, emits_, __ATOMIC_RELAXED);
+    emits_ = 0;
+}
+
+// Next task of the local queue, NULL once it is empty
+map_task_t* take_local_task() {
+    int task = __atomic_fetch_add(&context_->next_map_task, 1, __ATOMIC_RELAXED);
+    if (task >= context_->num_map_tasks) {
+        return NULL;
+    }
+    if (context_->prefetch > 0) {  // The prefetcher can read one more task ahead
+        pthread_mutex_lock(&context_->prefetch_lock);
+        pthread_cond_signal(&context_->prefetch_changed);
+        pthread_mutex_unlock(&context_->prefetch_lock);
+    }
+    return &context_->map_tasks[task];
+}
+
+void write_fully(int fd, struct iovec* iov, int iovcnt);
+
+void send_fully(int fd, const void* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        assert(sent > 0);  // Another process of the cluster failed
+        data = (const char*) data + sent;
+        length -= (size_t) sent;
+    }
+}
+
+// Returns 0 if the connection was closed (or the file ended) before length bytes were received
+int receive_fully(int fd, void* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = read(fd, data, length);  // Also reads the outputs of tasks run in child processes
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return 0;
+        }
+        data = (char*) data + received;
+        length -= (size_t) received;
+    }
+    return 1;
+}
+
+// Next task handed out by the coordinator, whose file name replaces the one of the previous task, NULL once the
+//   coordinator's queue is empty
+map_task_t* take_map_task(map_task_t* remote_task) {
+    if (context_->coordinator_fd < 0) {
+        return take_local_task();
+    }
+    uint32_t name_length;
+    uint64_t range[2];
+    pthread_mutex_lock(&context_->coordinator_lock);
+    send_fully(context_->coordinator_fd, "", 1);
+    int received = receive_fully(context_->coordinator_fd, &name_length, sizeof(name_length));
+    assert(received);
+    name_length = ntohl(name_length);
+    if (name_length == NO_MORE_TASKS) {
+        pthread_mutex_unlock(&context_->coordinator_lock);
+        return NULL;
+    }
+    free(remote_task->file_name);
+    remote_task->file_name = malloc(name_length + 1);
+    assert(remote_task->file_name);
+    received = receive_fully(context_->coordinator_fd, remote_task->file_name, name_length);
+    received = received && receive_fully(context_->coordinator_fd, range, sizeof(range));
+    assert(received);
+    pthread_mutex_unlock(&context_->coordinator_lock);
+    remote_task->file_name[name_length] = '\0';
+    remote_task->offset = (long) be64toh(range[0]);
+    remote_task->length = (long) be64toh(range[1]);
+    return remote_task;
+}
+
+// Coordinator thread, answers the task requests of another process until it closes the connection
+void serve_tasks_(void* argument) {
+    int fd = (int) (intptr_t) argument;
+    char request;
+    while (receive_fully(fd, &request, 1)) {
+        map_task_t* map_task = take_local_task();
+        uint32_t name_length = htonl(map_task ? (uint32_t) strlen(map_task->file_name) : NO_MORE_TASKS);
+        send_fully(fd, &name_length, sizeof(name_length));
+        if (map_task) {
+            uint64_t range[2] = {htobe64((uint64_t) map_task->offset), htobe64((uint64_t) map_task->length)};
+            send_fully(fd, map_task->file_name, strlen(map_task->file_name));
+            send_fully(fd, range, sizeof(range));
+        }
+    }
+    close(fd);
+}
+
+// Makes room for length more bytes after the used ones in the calling thread's frame
+char* reserve_frame(size_t used, size_t length) {
+    if (used + length > frame_capacity_) {
+        frame_capacity_ = used + length > 2 * frame_capacity_ ? used + length : 2 * frame_capacity_;
+        frame_ = realloc(frame_, frame_capacity_);
+        assert(frame_);
+    }
+    return frame_ + used;
+}
+
+// Same encoding as write_varint, returns the bytes used
+size_t frame_varint(size_t used, size_t n) {
+    char* p = reserve_frame(used, 10);
+    size_t length = 0;
+    while (n >= 0x80) {
+        p[length++] = (char) ((n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    p[length++] = (char) n;
+    return used + length;
+}
+
+size_t frame_string(size_t used, const char* string, size_t length) {
+    used = frame_varint(used, length);
+    memcpy(reserve_frame(used, length), string, length);
+    return used + length;
+}
+
+size_t get_varint(const char** p) {
+    size_t n = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        c = (unsigned char) *(*p)++;
+        n |= (size_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return n;
+}
+
+// Sends the frame built after its header to the process reducing the partition. The payload is a list of keys,
+//   each one followed by its number of values and the values, strings being a length followed by their bytes.
+void send_frame(uint32_t partition_number, size_t used) {
+    int node = (int) (partition_number % context_->num_nodes);
+    uint32_t* header = (uint32_t*) reserve_frame(0, FRAME_HEADER);
+    header[0] = htonl(partition_number);
+    header[1] = htonl((uint32_t) (used - FRAME_HEADER));
+    if (task_fd_ >= 0) {
+        struct iovec iov = {frame_, used};
+        write_fully(task_fd_, &iov, 1);
+        return;
+    }
+    pthread_mutex_lock(&context_->node_locks[node]);
+    send_fully(context_->node_fds[node], frame_, used);
+    pthread_mutex_unlock(&context_->node_locks[node]);
+}
+
+// Sends the buffered emits to the process reducing the partition, after combining them, the buffer is left empty
+void send_buffer(buffer_t* buffer, int partition_number) {
+    size_t used = FRAME_HEADER;
+    if (context_->shuffle == MR_SHUFFLE_SORT) {
+        for (int i = 0; i < buffer->num_emits; i++) {
+            record_t* record = &buffer->records[i];
+            used = frame_string(used, record->key, record->key_length);
+            used = frame_varint(used, 1);
+            used = frame_string(used, record->value, record->value_length);
+        }
+    } else {
+        if (context_->combiner) {
+            combine_buffer(buffer, partition_number);
+        }
+        table_t* local = &buffer->table;
+        for (unsigned long i = 0; i < local->capacity; i++) {
+            entry_t* entry = local->slots[i].entry;
+            if (!entry || !entry->head) {
+                continue;
+            }
+            size_t num_values = 0;
+            for (values_t* node = entry->head; node; node = node->next) {
+                num_values += node->count;
+            }
+            used = frame_string(used, entry->key, entry->key_length);
+            used = frame_varint(used, num_values);
+            for (values_t* node = entry->head; node; node = node->next) {
+                for (int j = 0; j < node->count; j++) {
+                    used = frame_string(used, node->values[j], value_length(node->values[j]));
+                }
+            }
+        }
+        memset(local->slots, 0, local->capacity * sizeof(slot_t));
+        local->count = 0;
+    }
+    send_frame((uint32_t) partition_number, used);
+    buffer->num_emits = 0;
+    buffer->num_hot = 0;
+    free_arena(&buffer->arena);
+}
+
+// Emit of a thread without buffers for a partition reduced by another process
+void send_pair(unsigned long partition_number, const char* key, size_t key_length, const char* value,
+               size_t value_length) {
+    size_t used = frame_string(FRAME_HEADER, key, key_length);
+    used = frame_varint(used, 1);
+    used = frame_string(used, value, value_length);
+    send_frame((uint32_t) partition_number, used);
+}
+
+void emit(unsigned long partition_number, unsigned long hash, const char* key, size_t key_length,
+          const char* value, size_t value_length);
+
+// Emits the pairs of the frames read from fd until the end frame, as a mapper would, returns 0 if fd ended before
+int emit_frames(int fd) {
+    char* payload = NULL;
+    size_t capacity = 0;
+    while (1) {
+        uint32_t header[2];
+        if (!receive_fully(fd, header, sizeof(header))) {
+            free(payload);
+            return 0;
+        }
+        uint32_t partition_number = ntohl(header[0]);
+        size_t length = ntohl(header[1]);
+        if (partition_number == END_OF_DATA) {
+            break;
+        }
+        assert(partition_number < (uint32_t) context_->num_partitions);
+        reserve_buffer(&payload, &capacity, length);
+        int received = receive_fully(fd, payload, length);
+        assert(received);
+        const char* p = payload;
+        while (p < payload + length) {
+            size_t key_length = get_varint(&p);
+            const char* key = p;
+            p += key_length;
+            for (size_t num_values = get_varint(&p); num_values > 0; num_values--) {
+                size_t value_length = get_varint(&p);
+                emit(partition_number, hash_key(key, key_length), key, key_length, p, value_length);
+                p += value_length;
+            }
+        }
+    }
+    free(payload);
+    return 1;
+}
+
+// Receiver thread, emits the pairs another process sends for the partitions of this one
+void receive_(void* argument) {
+    int fd = (int) (intptr_t) argument;
+    open_buffers();
+    int complete = emit_frames(fd);
+    assert(complete);  // The other process failed before sending all its frames
+    close(fd);
+    emits_ = 0;  // Counted by the process that made them
+    close_buffers();
+}
+
+// Splits "host:port" and resolves it, port is also the one this process listens on when host is NULL (IPv4)
+struct addrinfo* resolve_node(const char* address, int passive) {
+    char host[256];
+    const char* colon = strrchr(address, ':');
+    assert(colon && (size_t) (colon - address) < sizeof(host));  // Cluster addresses are host:port
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int resolved = getaddrinfo(passive ? NULL : host, colon + 1, &hints, &info);
+    assert(resolved == 0);
+    return info;
+}
+
+// Connects to the process and says what the connection is for
+int connect_node(const char* address, uint32_t hello) {
+    struct addrinfo* info = resolve_node(address, 0);
+    int fd = -1;
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS && fd < 0; attempt++) {
+        fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        assert(fd >= 0);
+        if (connect(fd, info->ai_addr, info->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+            usleep(100000);  // Not listening yet
+        }
+    }
+    freeaddrinfo(info);
+    assert(fd >= 0);  // The process never started
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // Task requests are small
+    uint32_t message[2] = {htonl(hello), htonl((uint32_t) context_->node)};
+    send_fully(fd, message, sizeof(message));
+    return fd;
+}
+
+// Connects to every other process of the cluster, and starts a thread for every connection they make
+void join_cluster(char** cluster, int node) {
+    int num_nodes = 0;
+    while (cluster[num_nodes]) {
+        num_nodes++;
+    }
+    assert(node >= 0 && node < num_nodes);
+    context_->num_nodes = num_nodes;
+    context_->node = node;
+    struct addrinfo* info = resolve_node(cluster[node], 1);
+    int listener = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));  // The previous run's port may linger
+    int listening = listener >= 0 && bind(listener, info->ai_addr, info->ai_addrlen) == 0 && listen(listener, 2 * num_nodes) == 0;
+    assert(listening);
+    freeaddrinfo(info);
+
+    context_->node_fds = malloc(num_nodes * sizeof(int));
+    context_->node_locks = malloc(num_nodes * sizeof(pthread_mutex_t));
+    assert(context_->node_fds && context_->node_locks);
+    for (int i = 0; i < num_nodes; i++) {  // Connecting only needs the others to listen, not to accept
+        context_->node_fds[i] = i == node ? -1 : connect_node(cluster[i], HELLO_DATA);
+        pthread_mutex_init(&context_->node_locks[i], NULL);
+    }
+    context_->coordinator_fd = node == 0 ? -1 : connect_node(cluster[0], HELLO_TASKS);
+
+    // Every other process sends frames, and asks the coordinator for tasks
+    context_->num_cluster_threads = node == 0 ? 2 * (num_nodes - 1) : num_nodes - 1;
+    context_->cluster_threads = malloc(context_->num_cluster_threads * sizeof(worker_t*));
+    assert(context_->cluster_threads);
+    for (int i = 0; i < context_->num_cluster_threads; i++) {
+        int fd = accept(listener, NULL, NULL);
+        assert(fd >= 0);
+        uint32_t message[2];
+        int received = receive_fully(fd, message, sizeof(message));
+        assert(received && (ntohl(message[0]) == HELLO_DATA || node == 0));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        void (*function)(void*) = ntohl(message[0]) == HELLO_DATA ? receive_ : serve_tasks_;
+        context_->cluster_threads[i] = pool_start(function, (void*) (intptr_t) fd);
+    }
+    close(listener);
+}
+
+// Once the mappers are done, tells the other processes this one won't send anything else and waits for them to be
+//   done as well, the partitions of this process then hold all their pairs.
+void leave_cluster() {
+    for (int i = 0; i < context_->num_nodes; i++) {
+        if (i != context_->node) {
+            uint32_t header[2] = {htonl(END_OF_DATA), 0};
+            pthread_mutex_lock(&context_->node_locks[i]);
+            send_fully(context_->node_fds[i], header, sizeof(header));
+            pthread_mutex_unlock(&context_->node_locks[i]);
+        }
+    }
+    if (context_->coordinator_fd >= 0) {  // Ends the coordinator's task server
+        close(context_->coordinator_fd);
+        context_->coordinator_fd = -1;
+    }
+    for (int i = 0; i < context_->num_cluster_threads; i++) {
+        pool_join(context_->cluster_threads[i]);
+    }
+    for (int i = 0; i < context_->num_nodes; i++) {
+        if (i != context_->node) {
+            close(context_->node_fds[i]);
+        }
+        pthread_mutex_destroy(&context_->node_locks[i]);
+    }
+    free(context_->node_fds);
+    free(context_->node_locks);
+    free(context_->cluster_threads);
+    context_->node_fds = NULL;
+    context_->node_locks = NULL;
+    context_->cluster_threads = NULL;
+    context_->num_cluster_threads = 0;
+}
+
+//Structure to group argues passed to map_
+typedef struct map_args{
+    Mapper  mapper;
+    SplitMapper  split_mapper;  // Used instead of mapper when set
+    int  mapper_num;
+}map_args_t ;
+
+
+// Hash of the options deciding the frames of a checkpoint, which are already partitioned and combined. Functions can't
+//   be told apart between builds, only the built-in partitioners are named, the job's checkpoint_id stands for the rest.
+unsigned long job_fingerprint() {
+    const char* partitioner = context_->partitioner == MR_DefaultHashPartition ? "default"
+                              : context_->partitioner == MR_DJB2HashPartition ? "djb2"
+                              : context_->partitioner == MR_RangePartition ? "range" : "custom";
+    char description[4096];
+    int length = snprintf(description, sizeof(description), "%s\n%d\n%d\n%s\n%lx\n%d\n%d",
+                          context_->checkpoint_id ? context_->checkpoint_id : "", context_->num_partitions,
+                          context_->num_nodes, partitioner, context_->hash_seed, context_->binary_values,
+                          context_->combiner != NULL);
+    assert(length < (int) sizeof(description));
+    unsigned long fingerprint = hash_key(description, length);
+    for (int i = 0; i < context_->num_range_splits; i++) {
+        fingerprint = fingerprint * 31 + hash_key(context_->range_splits[i].key, context_->range_splits[i].key_length);
+    }
+    return fingerprint;
+}
+
+// Name of the file the output of the task is kept in, changing with the file's size and modification time
+void checkpoint_path(map_task_t* map_task, char* path, size_t size) {
+    struct stat st;
+    if (stat(map_task->file_name, &st) != 0) {
+        st.st_size = 0;
+        st.st_mtime = 0;
+    }
+    char description[4096];
+    int length = snprintf(description, sizeof(description), "%s\n%ld\n%ld\n%ld\n%ld\n%016lx", map_task->file_name,
+                          map_task->offset, map_task->length, (long) st.st_size, (long) st.st_mtime, job_fingerprint());
+    snprintf(path, size, "%s/task-%016lx", context_->checkpoint_directory, djb2_hash(description) ^ hash_key(description, length));
+}
+
+// Child process of a task attempt, maps the task and writes the frames of its emits to fd
+__attribute__((noreturn)) void run_task_child(map_args_t* args, map_task_t* map_task, int fd) {
+    // The other threads are gone, locks they held would never be released
+    pthread_mutex_init(&context_->arenas_lock, NULL);
+    task_fd_ = fd;
+    open_buffers();  // Every buffer is "remote", sent to the file
+    if (args->split_mapper) {
+        args->split_mapper(map_task->file_name, map_task->offset, map_task->length);
+    } else {
+        args->mapper(map_task->file_name);
+    }
+    close_buffers();
+    uint32_t header[2] = {htonl(END_OF_DATA), 0};
+    struct iovec iov = {header, sizeof(header)};
+    write_fully(fd, &iov, 1);
+    fflush(NULL);
+    _exit(0);
+}
+
+// Runs the task in child processes until one succeeds or another attempt did (copy is 1 for a speculative copy,
+//   which isn't retried), and emits the output of the attempt that succeeded first
+void run_isolated(map_args_t* args, task_run_t* run, map_task_t* map_task, int copy) {
+    char path[4096], temp_path[4096 + 8];
+    if (context_->checkpoint_directory) {
+        checkpoint_path(map_task, path, sizeof(path));
+    }
+    for (int attempt = 1; ; attempt++) {
+        int fd;
+        if (context_->checkpoint_directory) {  // Renamed once complete, a crash can't leave a partial output
+            snprintf(temp_path, sizeof(temp_path), "%s-XXXXXX", path);
+            fd = mkstemp(temp_path);
+        } else {
+            fd = create_temp_file();
+        }
+        assert(fd >= 0);
+        fflush(NULL);  // Or the child would write what is buffered again
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            run_task_child(args, map_task, fd);
+        }
+        pthread_mutex_lock(&context_->task_lock);
+        run->pids[copy] = pid;
+        pthread_mutex_unlock(&context_->task_lock);
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        pthread_mutex_lock(&context_->task_lock);
+        run->pids[copy] = 0;
+        int lost = run->done;
+        int succeeded = !lost && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (succeeded) {
+            run->done = 1;
+            if (run->pids[!copy]) {  // The other attempt is useless now
+                kill(run->pids[!copy], SIGKILL);
+            }
+            context_->task_time += wall_time() - run->start;
+            context_->num_timed_tasks++;
+        }
+        pthread_mutex_unlock(&context_->task_lock);
+        if (succeeded) {
+            if (context_->checkpoint_directory) {
+                rename(temp_path, path);
+            }
+            lseek(fd, 0, SEEK_SET);
+            int complete = emit_frames(fd);
+            assert(complete);
+        } else if (context_->checkpoint_directory) {
+            unlink(temp_path);
+        }
+        close(fd);
+        if (succeeded || lost || copy) {
+            break;
+        }
+        fprintf(stderr, "MR_Run: map task %s (offset %ld) failed, attempt %d of %d\n", map_task->file_name,
+                map_task->offset, attempt, context_->task_attempts);
+        if (attempt >= context_->task_attempts) {  // The task fails every time, the run can't be complete
+            fprintf(stderr, "MR_Run: giving up on map task %s (offset %ld)\n", map_task->file_name, map_task->offset);
+            abort();
+        }
+    }
+    if (copy) {  // The mapper can reuse the run once the copy is gone
+        pthread_mutex_lock(&context_->task_lock);
+        run->speculated = 2;
+        pthread_cond_broadcast(&context_->task_changed);
+        pthread_mutex_unlock(&context_->task_lock);
+    }
+}
+
+// Maps the task in child processes, or emits its checkpointed output if a previous run completed it
+void map_isolated(map_args_t* args, map_task_t* map_task) {
+    if (context_->checkpoint_directory) {
+        char path[4096];
+        checkpoint_path(map_task, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            int complete = emit_frames(fd);
+            close(fd);
+            assert(complete);  // Checkpoints are renamed once complete
+            return;
+        }
+    }
+    task_run_t* run = &context_->task_runs[args->mapper_num];
+    pthread_mutex_lock(&context_->task_lock);
+    run->task = map_task;
+    run->start = wall_time();
+    run->done = 0;
+    run->speculated = 0;
+    pthread_mutex_unlock(&context_->task_lock);
+    run_isolated(args, run, map_task, 0);
+    pthread_mutex_lock(&context_->task_lock);
+    while (run->speculated == 1) {  // Wait for the copy to be done with the run
+        pthread_cond_wait(&context_->task_changed, &context_->task_lock);
+    }
+    run->task = NULL;
+    pthread_mutex_unlock(&context_->task_lock);
+}
+
+// Once the queue is empty, starts copies of the tasks running SPECULATION_FACTOR times longer than the average task,
+//   until every task left has a copy or is done
+void speculate(map_args_t* args) {
+    while (1) {
+        task_run_t* straggler = NULL;
+        int running = 0;
+        pthread_mutex_lock(&context_->task_lock);
+        double now = wall_time();
+        double average = context_->num_timed_tasks ? context_->task_time / context_->num_timed_tasks : 0;
+        for (int i = 0; i < context_->num_task_runs && !straggler; i++) {
+            task_run_t* run = &context_->task_runs[i];
+            if (run->task && !run->done && !run->speculated) {
+                running++;
+                double elapsed = now - run->start;
+                if (context_->num_timed_tasks > 0 && elapsed > SPECULATION_FACTOR * average && elapsed > MIN_SPECULATION_TIME) {
+                    straggler = run;
+                    run->speculated = 1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&context_->task_lock);
+        if (straggler) {
+            run_isolated(args, straggler, straggler->task, 1);
+        } else if (!running) {
+            return;
+        } else {
+            usleep(SPECULATION_POLL);
+        }
+    }
+}
+
+
+// Mapper thread, maps files from the queue until it is empty, emits are buffered until the thread exits
+void map_(map_args_t * args) {
+    if (context_->numa) {
+        pin_thread(thread_node(args->mapper_num));
+    }
+    open_buffers();
+
+    map_task_t* map_task;
+    map_task_t remote_task = {NULL, 0, 0};  // Given by the coordinator
+    double busy = 0;
+    while ((map_task = take_map_task(&remote_task))) {
+        double start = wall_time();
+        if (context_->task_attempts > 0) {
+            map_isolated(args, map_task);
+        } else if (args->split_mapper) {
+            args->split_mapper(map_task->file_name, map_task->offset, map_task->length);
+        } else {
+            args->mapper(map_task->file_name);
+        }
+        busy += wall_time() - start;
+    }
+    double start = wall_time();
+    if (context_->task_attempts > 0) {
+        speculate(args);
+    }
+    free(remote_task.file_name);
+    int task;
+    while ((task = __atomic_fetch_add(&context_->next_replay_state, 1, __ATOMIC_RELAXED)) < context_->num_replay_states) {
+        replay_state(&context_->replay_states[task], task);  // Emitted like the records of a file
+    }
+    busy += wall_time() - start;
+    context_->mapper_busy[args->mapper_num] = busy;
+    close_buffers();
+}
+
+// Adds the key to the reservoir of the sampling thread, replacing a random one once it is full
+void sample_key(sample_t* sample, const char* key, size_t key_length) {
+    unsigned long seen = sample->seen++;
+    size_t i = sample->count;
+    if (sample->count == sample->capacity) {
+        // The seen th key replaces a kept one with probability capacity / (seen + 1)
+        i = (size_t) (((__uint128_t) fold_multiply(seen, 0x9e3779b97f4a7c15ULL ^ context_->hash_seed) * (seen + 1)) >> 64);
+        if (i >= sample->capacity) {
+            return;
+        }
+        free(sample->keys[i].key);
+    } else {
+        sample->count++;
+    }
+    sample->keys[i].key = malloc(key_length + 1);
+    assert(sample->keys[i].key);
+    memcpy(sample->keys[i].key, key, key_length);
+    sample->keys[i].key[key_length] = '\0';
+    sample->keys[i].key_length = key_length;
+}
+
+// Length of the beginning of the split mapped to sample its keys, ending on a newline
+long sample_length(map_task_t* map_task) {
+    long window = SAMPLE_BYTES / context_->num_map_tasks;
+    if (window < MIN_SAMPLE_WINDOW) {
+        window = MIN_SAMPLE_WINDOW;
+    }
+    if (map_task->length <= window) {
+        return map_task->length;
+    }
+    int fd = open(map_task->file_name, O_RDONLY);
+    if (fd < 0) {
+        return map_task->length;
+    }
+    long end = map_task->offset + map_task->length;
+    long length = align_split(fd, map_task->offset + window, end) - map_task->offset;
+    close(fd);
+    return length;
+}
+
+//Structure to group argues passed to sample_
+typedef struct sample_args{
+    map_args_t*  map_args;
+    sample_t  sample;
+}sample_args_t ;
+
+// Sampling thread, maps the beginning of the queued splits (or some of the files) and keeps a sample of the keys
+void sample_(sample_args_t * args) {
+    reservoir_ = &args->sample;
+    int task;
+    while ((task = __atomic_fetch_add(&context_->next_sample_task, 1, __ATOMIC_RELAXED)) < context_->num_sample_tasks) {
+        map_task_t* map_task = &context_->map_tasks[task * context_->sample_stride];
+        if (args->map_args->split_mapper) {
+            args->map_args->split_mapper(map_task->file_name, map_task->offset, sample_length(map_task));
+        } else {
+            args->map_args->mapper(map_task->file_name);
+        }
+    }
+    reservoir_ = NULL;
+}
+
+// Samples the keys the mappers emit and picks the num_partitions - 1 evenly spaced ones as the range splits
+void sample_range_splits(map_args_t* map_args, int num_mappers) {
+    if (map_args->split_mapper) {
+        context_->num_sample_tasks = context_->num_map_tasks;
+    } else {
+        context_->num_sample_tasks = context_->num_map_tasks < MAX_SAMPLE_FILES ? context_->num_map_tasks : MAX_SAMPLE_FILES;
+    }
+    context_->sample_stride = context_->num_sample_tasks > 0 ? context_->num_map_tasks / context_->num_sample_tasks : 1;
+    context_->next_sample_task = 0;
+
+    worker_t* sampler_threads[num_mappers + 1];
+    sample_args_t* samplers = malloc((num_mappers + 1) * sizeof(sample_args_t));
+    assert(samplers);
+    for (int i = 0; i < num_mappers; i++) {
+        samplers[i].map_args = map_args;
+        samplers[i].sample.capacity = (size_t) SAMPLES_PER_PARTITION * context_->num_partitions;
+        samplers[i].sample.keys = malloc(samplers[i].sample.capacity * sizeof(record_t));
+        assert(samplers[i].sample.keys);
+        samplers[i].sample.count = 0;
+        samplers[i].sample.seen = 0;
+        sampler_threads[i] = pool_start((void *) sample_, (void *) &samplers[i]);
+    }
+
+    size_t num_samples = 0;
+    for (int i = 0; i < num_mappers; i++) {
+        pool_join(sampler_threads[i]);
+        num_samples += samplers[i].sample.count;
+    }
+    record_t* samples = malloc((num_samples + 1) * sizeof(record_t));
+    assert(samples);
+    num_samples = 0;
+    for (int i = 0; i < num_mappers; i++) {
+        memcpy(&samples[num_samples], samplers[i].sample.keys, samplers[i].sample.count * sizeof(record_t));
+        num_samples += samplers[i].sample.count;
+        free(samplers[i].sample.keys);
+    }
+    free(samplers);
+    sort_records(samples, num_samples, 0);
+
+    // Partition i gets the keys from the i th split included to the next one excluded
+    context_->num_range_splits = num_samples > 0 ? context_->num_partitions - 1 : 0;
+    context_->range_splits = malloc((context_->num_range_splits + 1) * sizeof(record_t));
+    assert(context_->range_splits);
+    context_->owns_range_splits = 1;
+    for (int i = 0; i < context_->num_range_splits; i++) {
+        size_t j = (size_t) (i + 1) * num_samples / context_->num_partitions;
+        context_->range_splits[i] = samples[j];
+        samples[j].key = NULL;  // Kept by the split
+    }
+    for (size_t i = 0; i < num_samples; i++) {
+        free(samples[i].key);
+    }
+    free(samples);
+}
+
+// Partition of the key, the number of range splits that sort before or equal to it
+unsigned long range_partition(const char* key, size_t key_length) {
+    record_t record = {(char*) key, key_length, NULL, 0};
+    int low = 0;
+    int high = context_->num_range_splits;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (compare_records(&context_->range_splits[middle], &record) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void free_range_splits() {
+    if (context_->owns_range_splits) {
+        for (int i = 0; i < context_->num_range_splits; i++) {
+            free(context_->range_splits[i].key);
+        }
+        free(context_->range_splits);
+    }
+    context_->range_splits = NULL;
+    context_->num_range_splits = 0;
+    context_->owns_range_splits = 0;
+}
+
+//Structure to group argues passed to reduce_
+typedef struct reduce_args{
+    Reducer  reducer;
+    int  reducer_num;
+}reduce_args_t ;
+
+// Replaces the runs of the partition by one run of the records kept for the next run, their values combined per key
+void keep_runs(int partition_number) {
+    partition_t* partition = &context_->partitions[partition_number];
+    stream_state_t* state = &context_->stream_states[partition_number];
+    int num_runs = 0;
+    for (run_t* run = partition->runs; run; run = run->next) {
+        num_runs += run->count > 0;
+    }
+    run_cursor_t* cursors = malloc((num_runs + 1) * sizeof(run_cursor_t));
+    run_cursor_t** heap = malloc((num_runs + 1) * sizeof(run_cursor_t*));
+    assert(cursors && heap);
+    int size = 0;
+    for (run_t* run = partition->runs; run; run = run->next) {
+        if (run->count > 0) {
+            open_cursor(&cursors[size], run);
+            heap[size] = &cursors[size];
+            size++;
+        }
+    }
+    merge_t merge;
+    init_merge(&merge, heap, size);
+    current_merge_ = &merge;
+    while (next_merged_key(&merge)) {
+        char* key = arena_strndup(&state->arena, merge.key, merge.key_length);
+        char* combined = context_->combiner ? context_->combiner(merge.key, (Getter)get_next, partition_number) : NULL;
+        record_t* left;
+        while ((left = next_merged_record(&merge))) {  // Values the combiner didn't read
+            keep_record(state, key, merge.key_length, left->value, left->value_length);
+        }
+        if (combined) {
+            keep_record(state, key, merge.key_length, combined, combined_length(combined));
+            free_combined(combined);
+        }
+    }
+    current_merge_ = NULL;
+    free_merge(&merge);
+    for (int i = 0; i < size; i++) {
+        close_cursor(&cursors[i]);
+    }
+    free(cursors);
+    free(heap);
+
+    while (partition->runs) {
+        run_t* run = partition->runs;
+        partition->runs = run->next;
+        free(run->records);
+        free_arena(&run->arena);
+        if (run->file) {
+            fclose(run->file);
+        }
+        free(run);
+    }
+    run_t* run = malloc(sizeof(run_t));  // Its strings belong to the state
+    assert(run);
+    run->records = malloc((state->count + 1) * sizeof(record_t));
+    assert(run->records);
+    memcpy(run->records, state->records, state->count * sizeof(record_t));
+    run->count = state->count;
+    run->arena.head = NULL;
+    run->arena.size = 0;
+    run->arena.node = -1;
+    run->file = NULL;
+    run->next = NULL;
+    partition->runs = run;
+}
+
+// Reduces the keys of the partition in order, merging its runs
+void reduce_sorted(Reducer reduce, int partition_number) {
+    partition_t* partition = &context_->partitions[partition_number];
+    if (context_->stream) {
+        keep_runs(partition_number);
+    }
+    int num_runs = 0;
+    for (run_t* run = partition->runs; run; run = run->next) {
+        num_runs++;
+    }
+    run_cursor_t* cursors = malloc((num_runs + 1) * sizeof(run_cursor_t));
+    run_cursor_t** heap = malloc((num_runs + 1) * sizeof(run_cursor_t*));
+    assert(cursors && heap);
+    int size = 0;
+    for (run_t* run = partition->runs; run; run = run->next) {
+        if (run->count > 0) {
+            open_cursor(&cursors[size], run);
+            heap[size] = &cursors[size];
+            size++;
+        }
+    }
+
+    merge_t merge;
+    init_merge(&merge, heap, size);
+    current_merge_ = &merge;
+    while (next_merged_key(&merge)) {
+        reduce(merge.key, (Getter)get_next, partition_number);
+        partition->keys++;
+    }
+    current_merge_ = NULL;
+    free_merge(&merge);
+    for (int i = 0; i < size; i++) {
+        close_cursor(&cursors[i]);
+    }
+    free(cursors);
+    free(heap);
+}
+
+// Writes the iovcnt buffers to the file, whatever the number of write calls it takes
+void write_fully(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        assert(written >= 0);  // Out of disk space
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// File of the partition's output, created by the first block written
+int output_fd(int partition_number) {
+    partition_t* partition = &context_->partitions[partition_number];
+    if (partition->output_fd < 0) {
+        if (context_->output_directory) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/part-%05d", context_->output_directory, partition_number);
+            partition->output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            assert(partition->output_fd >= 0);
+        } else {
+            partition->output_fd = create_temp_file();  // Concatenated at the end of the run
+        }
+    }
+    return partition->output_fd;
+}
+
+// Writes the buffered output along with the extra buffers, in one system call if possible
+void flush_output(struct iovec* extra, int num_extra) {
+    struct iovec iov[num_extra + 1];
+    iov[0].iov_base = output_buffer_;
+    iov[0].iov_len = output_used_;
+    if (num_extra > 0) {
+        memcpy(&iov[1], extra, num_extra * sizeof(struct iovec));
+    }
+    write_fully(output_fd(output_partition_), output_used_ > 0 ? iov : iov + 1, num_extra + (output_used_ > 0));
+    output_used_ = 0;
+}
+
+// Ends the output of the partition the thread reduced, it is kept in memory if it was never written
+void finish_output() {
+    partition_t* partition = &context_->partitions[output_partition_];
+    if (partition->output_fd < 0 && !context_->output_directory) {
+        if (output_used_ > 0) {  // The buffer becomes the partition's, a new one is allocated by the next MR_Output
+            partition->output = realloc(output_buffer_, output_used_);
+            assert(partition->output);
+            partition->output_length = output_used_;
+            output_buffer_ = NULL;
+            output_used_ = 0;
+        }
+    } else if (output_used_ > 0) {
+        flush_output(NULL, 0);
+    }
+    if (context_->output_directory && partition->output_fd >= 0) {
+        close(partition->output_fd);
+        partition->output_fd = -1;
+    }
+    output_partition_ = -1;
+}
+
+// Orders the pairs by decreasing value, then by key, a NaN value ranking last
+int compare_ranked(const void* a, const void* b) {
+    const ranked_t* pair_a = a;
+    const ranked_t* pair_b = b;
+    if (pair_a->score > pair_b->score || (pair_b->score != pair_b->score && pair_a->score == pair_a->score)) {
+        return -1;
+    }
+    if (pair_a->score < pair_b->score || (pair_a->score != pair_a->score && pair_b->score == pair_b->score)) {
+        return 1;
+    }
+    return compare_records(&pair_a->record, &pair_b->record);
+}
 
-// Linked_List structure for thread safety
-typedef struct partition {
-    entry_t* head;
-    pthread_mutex_t lock;
-} partition_t;
+// Leading number of the value, 0 if it doesn't start with one
+double value_score(const char* value, size_t value_length) {
+    char number[64];
+    size_t length = value_length < sizeof(number) - 1 ? value_length : sizeof(number) - 1;
+    memcpy(number, value, length);
+    number[length] = '\0';
+    return strtod(number, NULL);
+}
 
+// Moves the pair at index down the heap until its children rank before it
+void sift_top(top_t* top, int index) {
+    ranked_t pair = top->pairs[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= top->count) {
+            break;
+        }
+        if (child + 1 < top->count && compare_ranked(&top->pairs[child + 1], &top->pairs[child]) > 0) {
+            child++;
+        }
+        if (compare_ranked(&top->pairs[child], &pair) <= 0) {
+            break;
+        }
+        top->pairs[index] = top->pairs[child];
+        index = child;
+    }
+    top->pairs[index] = pair;
+}
 
-// Global variables
-partition_t *partitions;
-int num_partitions;
-Partitioner partitioner_; //MrDefaultHash by default
+// Copies length bytes in a malloc'd block, followed by a NUL, binary keys and values may hold NULs themselves
+char* copy_bytes(const char* bytes, size_t length) {
+    char* copy = malloc(length + 1);
+    assert(copy);
+    memcpy(copy, bytes, length);
+    copy[length] = '\0';
+    return copy;
+}
 
-// Helper function to generate a new entry node
-entry_t* generate_entry(char* key) {
-    entry_t* entry_node = malloc(sizeof(entry_t));
-    entry_node->key = strdup(key);
-    entry_node->next = NULL;
-    entry_node->head = NULL;
-    assert(entry_node);  // Ensure memory allocation was successful
-    return entry_node;
+// Keeps a copy of the pair if it is one of the top_k best output in the partition so far
+void keep_top(top_t* top, const char* key, size_t key_length, const char* value, size_t value_length) {
+    ranked_t pair = {{(char*) key, key_length, (char*) value, value_length}, value_score(value, value_length)};
+    if (!top->pairs) {
+        top->pairs = malloc(context_->top_k * sizeof(ranked_t));
+        assert(top->pairs);
+    }
+    int index;
+    if (top->count < context_->top_k) {  // Moved up from the new leaf
+        index = top->count++;
+        while (index > 0 && compare_ranked(&top->pairs[(index - 1) / 2], &pair) < 0) {
+            top->pairs[index] = top->pairs[(index - 1) / 2];
+            index = (index - 1) / 2;
+        }
+    } else if (compare_ranked(&pair, &top->pairs[0]) < 0) {  // Replaces the worst pair
+        free(top->pairs[0].record.key);
+        free(top->pairs[0].record.value);
+        index = 0;
+    } else {
+        return;
+    }
+    pair.record.key = copy_bytes(key, key_length);
+    pair.record.value = copy_bytes(value, value_length);
+    top->pairs[index] = pair;
+    if (index == 0) {
+        sift_top(top, 0);
+    }
 }
 
-// Function to get an entry or create a new one for the given key
-entry_t* get_entry(char* key) {
-    unsigned long partition_number = partitioner_(key, num_partitions);  // Find the corresponding partition
-    entry_t* current = partitions[partition_number].head;
+// Merges the heaps of the partitions and writes the top_k best pairs by decreasing value
+void output_top() {
+    size_t count = 0;
+    for (int i = 0; i < context_->num_partitions; i++) {
+        count += context_->partitions[i].top.count;
+    }
+    ranked_t* pairs = malloc((count + 1) * sizeof(ranked_t));
+    assert(pairs);
+    size_t length = 0;
+    count = 0;
+    for (int i = 0; i < context_->num_partitions; i++) {
+        top_t* top = &context_->partitions[i].top;
+        if (top->count == 0) {  // Nothing output in the partition, its pairs are NULL
+            continue;
+        }
+        memcpy(&pairs[count], top->pairs, top->count * sizeof(ranked_t));
+        count += top->count;
+        free(top->pairs);
+        top->pairs = NULL;
+        top->count = 0;
+    }
+    qsort(pairs, count, sizeof(ranked_t), compare_ranked);
+    size_t kept = count < (size_t) context_->top_k ? count : (size_t) context_->top_k;
+    for (size_t i = 0; i < kept; i++) {
+        length += pairs[i].record.key_length + pairs[i].record.value_length + 2;
+    }
+    char* text = malloc(length + 1);
+    assert(text);
+    char* end = text;
+    for (size_t i = 0; i < count; i++) {
+        if (i < kept) {
+            memcpy(end, pairs[i].record.key, pairs[i].record.key_length);
+            end += pairs[i].record.key_length;
+            *end++ = ' ';
+            memcpy(end, pairs[i].record.value, pairs[i].record.value_length);
+            end += pairs[i].record.value_length;
+            *end++ = '\n';
+        }
+        free(pairs[i].record.key);
+        free(pairs[i].record.value);
+    }
+    free(pairs);
+
+    int fd;
+    if (context_->output_directory) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/top-%05d", context_->output_directory, context_->node);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        fflush(stdout);  // What the Reducers printed comes first
+        fd = context_->output_file ? open(context_->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    }
+    assert(fd >= 0);
+    struct iovec iov = {text, length};
+    write_fully(fd, &iov, 1);
+    free(text);
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+}
 
-    // Traverse the list to find an entry with the key
-    while (current) {
-        if (strcmp(current->key, key) == 0) {  // Found an entry
-            return current;
+// Writes the partitions one after the other to the output file, or to the standard output
+void concatenate_outputs() {
+    int fd = -1;
+    char* block = NULL;
+    for (int i = 0; i < context_->num_partitions; i++) {
+        partition_t* partition = &context_->partitions[i];
+        if (!partition->output && partition->output_fd < 0) {
+            continue;
+        }
+        if (fd < 0) {
+            fflush(stdout);  // What the Reducers printed comes first
+            fd = context_->output_file ? open(context_->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+            assert(fd >= 0);
+        }
+        if (partition->output) {
+            struct iovec iov = {partition->output, partition->output_length};
+            write_fully(fd, &iov, 1);
+            free(partition->output);
+            partition->output = NULL;
+            continue;
+        }
+        if (!block) {
+            block = malloc(OUTPUT_BUFFER_SIZE);
+            assert(block);
         }
-        current = current->next;
+        ssize_t n;
+        off_t offset = 0;
+        while ((n = pread(partition->output_fd, block, OUTPUT_BUFFER_SIZE, offset)) > 0) {
+            struct iovec iov = {block, n};
+            write_fully(fd, &iov, 1);
+            offset += n;
+        }
+        close(partition->output_fd);
+        partition->output_fd = -1;
+    }
+    free(block);
+    if (fd >= 0 && fd != STDOUT_FILENO) {
+        close(fd);
     }
+}
 
-    // If key not found, create a new entry and insert at the beginning
-    entry_t* entry_node = generate_entry(key);
-    entry_node->next = partitions[partition_number].head;
-    partitions[partition_number].head = entry_node;
-    return entry_node;
+// Combines the values of the entry and keeps what is left for the next run, the Reducer then reads them
+void keep_entry(entry_t* entry, int partition_number) {
+    stream_state_t* state = &context_->stream_states[partition_number];
+    if (context_->combiner) {
+        combine_entry(entry, &context_->partitions[partition_number].arena, partition_number);
+    }
+    char* key = NULL;
+    for (values_t* node = entry->head; node; node = node->next) {
+        for (int i = 0; i < node->count; i++) {
+            key = key ? key : arena_strndup(&state->arena, entry->key, entry->key_length);
+            keep_record(state, key, entry->key_length, node->values[i], value_length(node->values[i]));
+        }
+    }
 }
 
+// Calls the reduce function for each key of the partition
+void reduce_partition(Reducer reduce, int partition_number) {
+    output_partition_ = partition_number;
+    if (context_->shuffle == MR_SHUFFLE_SORT) {
+        reduce_sorted(reduce, partition_number);
+        finish_output();
+        return;
+    }
+    table_t* table = &context_->partitions[partition_number].table;
+    context_->partitions[partition_number].keys = table->count;
+    for (unsigned long i = 0; i < table->capacity; i++) {
+        entry_t* entry = table->slots[i].entry;
+        if (entry) {
+            // Call the reduce function for each entry in the partition
+            if (context_->stream) {
+                keep_entry(entry, partition_number);
+            }
+            current_entry_ = entry;
+            reduce(entry->key, (Getter)get_next, partition_number);
+        }
+    }
+    current_entry_ = NULL;
+    finish_output();
+}
 
+// Sorts the partitions by decreasing estimated size
+int compare_partitions(const void* a, const void* b) {
+    size_t size_a = context_->partitions[*(const int*) a].size;
+    size_t size_b = context_->partitions[*(const int*) b].size;
+    return (size_a < size_b) - (size_a > size_b);
+}
 
-char* get_next(char* key, int partition_number) {
-    partition_t* partition = &partitions[partition_number];
-    entry_t* entry = partition->head;
-
-    while (entry) {
-        if (strcmp(entry->key, key) == 0) {
-            values_t *value_head = entry->head;
-            if (value_head) {
-                char* ret_val = strdup(value_head->value); //Will be freed after usage in Reduce
-                entry->head = value_head->next;
-                free(value_head->value);  // Free the value string
-                free(value_head);         // Free the value node
-                return ret_val;
+// Builds the queue of partitions to reduce, biggest first so that the small ones fill the gaps at the end
+void init_reduce_tasks() {
+    context_->num_reduce_tasks = 0;
+    for (int i = 0; i < context_->num_partitions; i++) {
+        if (i % context_->num_nodes == context_->node) {  // The other processes reduce the others
+            context_->reduce_tasks[context_->num_reduce_tasks++] = i;
+        }
+    }
+    qsort(context_->reduce_tasks, context_->num_reduce_tasks, sizeof(int), compare_partitions);
+    context_->next_reduce_task = 0;
+    if (context_->numa) {  // Grouped by node, each group still biggest first
+        int* sorted = malloc(context_->num_partitions * sizeof(int));
+        assert(sorted);
+        int task = 0;
+        for (int node = 0; node < num_nodes_; node++) {
+            context_->node_tasks[node] = task;
+            context_->next_node_task[node] = task;
+            for (int i = 0; i < context_->num_reduce_tasks; i++) {
+                if (partition_node(context_->reduce_tasks[i]) == node) {
+                    sorted[task++] = context_->reduce_tasks[i];
+                }
             }
+        }
+        context_->node_tasks[num_nodes_] = task;
+        free(context_->reduce_tasks);
+        context_->reduce_tasks = sorted;
+    }
+}
+
+// Merges the batch in the partition table, combining the values of the keys it holds
+void merge_batch(table_t* table, table_t* batch, int partition_number) {
+    for (unsigned long i = 0; i < batch->capacity; i++) {
+        entry_t* entry = batch->slots[i].entry;
+        if (entry && (entry = merge_entry(table, entry)) && context_->combiner) {
+            combine_entry(entry, arena_, partition_number);
+        }
+    }
+    free(batch->slots);
+}
+
+// Pipeline mode, merges the batches of the reducer's partitions as the mappers produce them,
+//   until the map phase is over
+void consume_batches(int reducer_number) {
+    inbox_t* inbox = &context_->inboxes[reducer_number];
+    double busy = 0;
+    pthread_mutex_lock(&inbox->lock);
+    while (1) {
+        while (!inbox->batches && !inbox->closed) {
+            pthread_cond_wait(&inbox->ready, &inbox->lock);
+        }
+        if (!inbox->batches) {  // Closed and drained
             break;
         }
-        entry = entry->next;
+        batch_t* batches = inbox->batches;
+        inbox->batches = NULL;
+        pthread_mutex_unlock(&inbox->lock);  // Mappers can push batches while these are merged
+
+        double start = wall_time();
+        while (batches) {
+            batch_t* batch = batches;
+            batches = batch->next;
+            partition_t* partition = &context_->partitions[batch->partition_number];
+            merge_batch(&partition->table, &batch->table, batch->partition_number);
+            partition->size += batch->num_emits;
+            free(batch);
+        }
+        busy += wall_time() - start;
+        pthread_mutex_lock(&inbox->lock);
     }
-    return NULL;
+    pthread_mutex_unlock(&inbox->lock);
+
+    for (int i = reducer_number; i < context_->num_partitions; i += context_->num_reducers) {  // Emits made outside of the mappers
+        partition_t* partition = &context_->partitions[i];
+        if (partition->pending.num_emits > 0) {
+            merge_batch(&partition->table, &partition->pending.table, i);
+            partition->size += partition->pending.num_emits;
+            init_table(&partition->pending.table);
+            partition->pending.num_emits = 0;
+        }
+    }
+    context_->reducer_busy[reducer_number] = busy;
 }
 
-//Structure to group argues passed to reduce_
-typedef struct reduce_args{
-    Reducer  reducer;
-    int  partition_num;
-}reduce_args_t ;
+// Next partition the reducer should reduce, the ones of its node first with numa, -1 once they are all taken
+int next_reduce_partition(int reducer_number) {
+    if (!context_->numa) {
+        int task = __atomic_fetch_add(&context_->next_reduce_task, 1, __ATOMIC_RELAXED);
+        return task < context_->num_reduce_tasks ? context_->reduce_tasks[task] : -1;
+    }
+    int home = thread_node(reducer_number);
+    for (int i = 0; i < num_nodes_; i++) {  // Then help the other nodes
+        int node = (home + i) % num_nodes_;
+        int task = __atomic_fetch_add(&context_->next_node_task[node], 1, __ATOMIC_RELAXED);
+        if (task < context_->node_tasks[node + 1]) {
+            return context_->reduce_tasks[task];
+        }
+    }
+    return -1;
+}
 
-// Wrapper for the reduce function to process data after the Map phase
+// Reducer thread, reduces partitions from the queue until it is empty
 void reduce_(reduce_args_t * args) {
     Reducer reduce = args->reducer;
-    int partition_number = args->partition_num;
-    partition_t* partition = &partitions[partition_number];
-    entry_t* entry = partition->head;
-    while (entry) {
-        // Call the reduce function for each entry in the partition
-        reduce(entry->key, (Getter)get_next, partition_number);
-        entry = entry->next;
+    if (context_->numa) {
+        pin_thread(thread_node(args->reducer_num));
+    }
+    if (context_->pipeline) {
+        arena_ = register_arena();  // For the combined values
+        consume_batches(args->reducer_num);
+        if (pthread_barrier_wait(&context_->reduce_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {  // Sizes are known now
+            init_reduce_tasks();
+            context_->reduce_start = wall_time();
+        }
+        pthread_barrier_wait(&context_->reduce_barrier);
+    }
+    int partition_number;
+    double start = wall_time();
+    while ((partition_number = next_reduce_partition(args->reducer_num)) >= 0) {
+        reduce_partition(reduce, partition_number);
     }
+    context_->reducer_busy[args->reducer_num] += wall_time() - start;
+    free(output_buffer_);
+    output_buffer_ = NULL;
+    arena_ = NULL;
     free(args);
 }
 
-//To free the memory
+//To free the memory, nodes and strings all live in the arenas
 void cleanup_partitions() {
-    for (int i = 0; i < num_partitions; i++) {
-        entry_t* entry = partitions[i].head;
-        while (entry) {
-            values_t* value = entry->head;
-            while (value) {
-                values_t* tmp_value = value;
-                value = value->next;
-                free(tmp_value->value);
-                free(tmp_value);
+    for (int i = 0; i < context_->num_partitions; i++) {
+        free(context_->partitions[i].table.slots);
+        while (context_->partitions[i].runs) {
+            run_t* run = context_->partitions[i].runs;
+            context_->partitions[i].runs = run->next;
+            free(run->records);
+            free_arena(&run->arena);
+            if (run->file) {
+                fclose(run->file);
             }
-            entry_t* tmp_entry = entry;
-            entry = entry->next;
-            free(tmp_entry->key);
-            free(tmp_entry);
+            free(run);
         }
-        pthread_mutex_destroy(&partitions[i].lock);
+        free(context_->partitions[i].pending.table.slots);
+        free(context_->partitions[i].pending.records);
+        free_arena(&context_->partitions[i].pending.arena);
+        free_arena(&context_->partitions[i].arena);
+        pthread_mutex_destroy(&context_->partitions[i].lock);
+    }
+    free(context_->partitions);
+    free(context_->reduce_tasks);
+    while (context_->arenas) {
+        arena_t* arena = context_->arenas;
+        context_->arenas = arena->next;
+        free_arena(arena);
+        free(arena);
     }
-    free(partitions);
 }
 
 
 //Prints the partition's content
 __attribute__((unused)) void display_partitions(){
-    for(int i=0;i<num_partitions;i++){
-        entry_t * entry = partitions[i].head;
-        while (entry){
+    for(int i=0;i<context_->num_partitions;i++){
+        table_t * table = &context_->partitions[i].table;
+        for(unsigned long j=0;j<table->capacity;j++){
+            entry_t * entry = table->slots[j].entry;
+            if (!entry){
+                continue;
+            }
             printf("key : \"%s\", values :",entry->key);
             values_t * value = entry->head;
             while (value){
-                printf("\"\t%s\t\"",value->value);
+                for (int k = 0; k < value->count; k++) {
+                    printf("\"\t%s\t\"",value->values[k]);
+                }
                 value=value->next;
             }
             printf("\n");
-            entry=entry->next;
         }
     }
 }
 
 
+// Adds the pair to the partition, or to the mapper's buffer for it, hash being the hash of the key
+void emit(unsigned long partition_number, unsigned long hash, const char* key, size_t key_length,
+          const char* value, size_t value_length) {
+    if (!buffers_) {  // Not a mapper thread, emits_ won't be added up
+        __atomic_add_fetch(&context_->total_emits, 1, __ATOMIC_RELAXED);
+    }
+    emits_++;
+    if (buffers_ && context_->batch_size > 1) {  // Called from a mapper thread, no lock needed until the buffer is full
+        buffer_t* buffer = &buffers_[partition_number];
+        if (context_->shuffle == MR_SHUFFLE_SORT) {
+            add_record(buffer, key, key_length, value, value_length);
+        } else {
+            arena_t* arena = buffer->remote ? &buffer->arena : arena_;  // Freed once the buffer is sent
+            entry_t* entry = get_entry(&buffer->table, arena, key, key_length, hash);
+            add_value(entry, arena, value, value_length);
+            ++buffer->num_emits;
+            if (entry->head->count == entry->head->capacity) {
+                check_hot_key(buffer, entry, arena, partition_number);
+            }
+        }
+        if (buffer->num_emits - buffer->num_hot >= context_->batch_size ||
+            buffer->num_emits >= context_->batch_size * HOT_BATCH_FACTOR) {
+            flush_buffer(buffer, partition_number);
+        }
+        return;
+    }
+    if (task_fd_ >= 0 || (context_->num_nodes > 1 && (int) (partition_number % context_->num_nodes) != context_->node)) {
+        send_pair(partition_number, key, key_length, value, value_length);
+        return;
+    }
+
+    partition_t* partition = &context_->partitions[partition_number];
+    lock_partition(partition); //Lock to prevent concurrency issues
+
+    if (context_->shuffle == MR_SHUFFLE_SORT) {  // Sorted as one run at the end of the map phase
+        add_record(&partition->pending, key, key_length, value, value_length);
+        pthread_mutex_unlock(&partition->lock);
+        return;
+    }
+
+    if (context_->pipeline) {  // The partition table belongs to the reducer, which merges these at the end of the map phase
+        entry_t* entry = get_entry(&partition->pending.table, &partition->arena, key, key_length, hash);
+        add_value(entry, &partition->arena, value, value_length);
+        partition->pending.num_emits++;
+        pthread_mutex_unlock(&partition->lock);
+        return;
+    }
+
+    // Get or create the entry for the key, then add the value to it
+    entry_t* entry = get_entry(&partition->table, &partition->arena, key, key_length, hash);
+    add_value(entry, &partition->arena, value, value_length);
+    partition->size++;
+
+    pthread_mutex_unlock(&partition->lock);  // Unlock after modification
+}
+
 void MR_Emit(char* key, char* value) {
-    unsigned long partition_number = partitioner_(key, num_partitions);
-    pthread_mutex_lock(&partitions[partition_number].lock); //Lock to prevent concurrency issues
+    if (!context_) {  // Thread not started by a run, the pair goes to the last one started
+        context_ = __atomic_load_n(&running_context_, __ATOMIC_RELAXED);
+        MR_Emit(key, value);
+        context_ = NULL;
+        return;
+    }
+    size_t key_length = strlen(key);
+    if (reservoir_) {
+        sample_key(reservoir_, key, key_length);
+        return;
+    }
+    unsigned long hash = hash_key(key, key_length);
+    unsigned long partition_number;
+    if (context_->partitioner == MR_DefaultHashPartition) {  // Don't hash the key twice
+        partition_number = reduce_hash(hash, context_->num_partitions);
+    } else if (context_->partitioner == MR_RangePartition) {
+        partition_number = range_partition(key, key_length);
+    } else {
+        partition_number = context_->partitioner(key, context_->num_partitions);
+    }
+    emit(partition_number, hash, key, key_length, value, strlen(value));
+}
+
+void MR_Output(char* key, char* value) {
+    MR_OutputN(key, strlen(key), value, strlen(value));
+}
+
+void MR_OutputN(const char* key, size_t key_length, const char* value, size_t value_length) {
+    assert(output_partition_ >= 0);  // Only Reducers output pairs
+    if (context_->top_k > 0) {
+        keep_top(&context_->partitions[output_partition_].top, key, key_length, value, value_length);
+        return;
+    }
+    size_t length = key_length + value_length + 2;
+    if (output_used_ + length > OUTPUT_BUFFER_SIZE) {
+        if (length > OUTPUT_BUFFER_SIZE / 4) {  // Written with the buffer instead of being copied
+            struct iovec pair[4] = {{(char*) key, key_length}, {" ", 1}, {(char*) value, value_length}, {"\n", 1}};
+            flush_output(pair, 4);
+            return;
+        }
+        flush_output(NULL, 0);
+    }
+    if (!output_buffer_) {
+        output_buffer_ = malloc(OUTPUT_BUFFER_SIZE);
+        assert(output_buffer_);
+    }
+    char* end = output_buffer_ + output_used_;
+    memcpy(end, key, key_length);
+    end[key_length] = ' ';
+    memcpy(end + key_length + 1, value, value_length);
+    end[length - 1] = '\n';
+    output_used_ += length;
+}
+
+void MR_EmitBytes(const void* key, size_t key_length, const void* value, size_t value_length) {
+    MR_EmitN(key, key_length, value, value_length);
+}
+
+void MR_EmitPartitioned(unsigned long partition_number, const void* key, size_t key_length,
+                        const void* value, size_t value_length) {
+    if (!context_) {
+        context_ = __atomic_load_n(&running_context_, __ATOMIC_RELAXED);
+        MR_EmitPartitioned(partition_number, key, key_length, value, value_length);
+        context_ = NULL;
+        return;
+    }
+    if (reservoir_) {
+        sample_key(reservoir_, key, key_length);
+        return;
+    }
+    assert(partition_number < (unsigned long) context_->num_partitions);
+    emit(partition_number, hash_key(key, key_length), key, key_length, value, value_length);
+}
+
+int MR_NumPartitions(void) {
+    MR_Context* context = context_ ? context_ : __atomic_load_n(&running_context_, __ATOMIC_RELAXED);
+    return context->num_partitions;
+}
+
+void MR_EmitN(const char* key, size_t key_length, const char* value, size_t value_length) {
+    if (!context_) {
+        context_ = __atomic_load_n(&running_context_, __ATOMIC_RELAXED);
+        MR_EmitN(key, key_length, value, value_length);
+        context_ = NULL;
+        return;
+    }
+    if (reservoir_) {
+        sample_key(reservoir_, key, key_length);
+        return;
+    }
+    unsigned long hash = hash_key(key, key_length);
+    unsigned long partition_number;
+    if (context_->partitioner == MR_DefaultHashPartition) {
+        partition_number = reduce_hash(hash, context_->num_partitions);
+    } else if (context_->partitioner == MR_RangePartition) {  // Compares the key with its length, no copy needed
+        partition_number = range_partition(key, key_length);
+    } else {  // The partitioner needs a NUL terminated key
+        char buffer[256];
+        char* key_copy = key_length < sizeof(buffer) ? buffer : malloc(key_length + 1);
+        assert(key_copy);
+        memcpy(key_copy, key, key_length);
+        key_copy[key_length] = '\0';
+        partition_number = context_->partitioner(key_copy, context_->num_partitions);
+        if (key_copy != buffer) {
+            free(key_copy);
+        }
+    }
+    emit(partition_number, hash, key, key_length, value, value_length);
+}
+
+int MR_OpenInput(char* file_name, long offset, long length, MR_Input* input) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (length < 0) {  // Up to the end of the file
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        length = (long) st.st_size - offset;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    long start = offset & ~(page_size - 1);  // mmap needs a page aligned offset
+    input->mapping = NULL;
+    input->mapping_length = (size_t) (offset - start + length);
+    input->data = NULL;
+    input->length = length;
+    input->position = 0;
+    if (length > 0) {
+        input->mapping = mmap(NULL, input->mapping_length, PROT_READ, MAP_PRIVATE, fd, start);
+        if (input->mapping == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(input->mapping, input->mapping_length, MADV_SEQUENTIAL);  // Read ahead aggressively
+        input->data = (const char*) input->mapping + (offset - start);
+    }
+    close(fd);  // The mapping stays valid
+    return 0;
+}
+
+int MR_NextRecord(MR_Input* input, const char** record, size_t* record_length) {
+    if (input->position >= input->length) {
+        return 0;
+    }
+    const char* start = input->data + input->position;
+    size_t remaining = (size_t) (input->length - input->position);
+    const char* newline = memchr(start, '\n', remaining);
+    *record = start;
+    *record_length = newline ? (size_t) (newline - start) + 1 : remaining;
+    input->position += (long) *record_length;
+    return 1;
+}
+
+void MR_CloseInput(MR_Input* input) {
+    if (input->mapping) {
+        munmap(input->mapping, input->mapping_length);
+        input->mapping = NULL;
+    }
+}
+
+// Delimiters of a tokenizer, compared a vector of bytes at a time when there are few of them
+typedef struct tokenizer {
+    unsigned char is_delimiter[256];
+    unsigned char delimiters[MAX_VECTOR_DELIMITERS];
+    int num_delimiters;  // 0 when there are too many to compare them in vectors
+    MR_TokenCallback callback;
+    void* argument;
+    size_t num_tokens;
+    size_t token_start;  // Offset of the first byte after the last delimiter
+} tokenizer_t;
+
+void init_tokenizer(tokenizer_t* tokenizer, const char* delimiters, MR_TokenCallback callback, void* argument) {
+    if (!delimiters) {
+        delimiters = DEFAULT_DELIMITERS;
+    }
+    memset(tokenizer->is_delimiter, 0, sizeof(tokenizer->is_delimiter));
+    tokenizer->num_delimiters = 0;
+    for (const unsigned char* d = (const unsigned char*) delimiters; *d; d++) {
+        if (!tokenizer->is_delimiter[*d]) {
+            tokenizer->is_delimiter[*d] = 1;
+            if (tokenizer->num_delimiters >= 0 && tokenizer->num_delimiters < MAX_VECTOR_DELIMITERS) {
+                tokenizer->delimiters[tokenizer->num_delimiters++] = *d;
+            } else {
+                tokenizer->num_delimiters = -1;
+            }
+        }
+    }
+    if (tokenizer->num_delimiters < 0) {
+        tokenizer->num_delimiters = 0;
+    }
+    tokenizer->callback = callback;
+    tokenizer->argument = argument;
+    tokenizer->num_tokens = 0;
+    tokenizer->token_start = 0;
+}
+
+// Ends the token before the delimiter at offset, consecutive delimiters make no empty token
+static inline void end_token(tokenizer_t* tokenizer, const char* data, size_t offset) {
+    if (offset > tokenizer->token_start) {
+        tokenizer->callback(data + tokenizer->token_start, offset - tokenizer->token_start, tokenizer->argument);
+        tokenizer->num_tokens++;
+    }
+    tokenizer->token_start = offset + 1;
+}
+
+// Ends the tokens before the delimiters whose bits are set in mask, bit i being the byte at base + i
+static inline void end_tokens(tokenizer_t* tokenizer, const char* data, size_t base, uint64_t mask) {
+    while (mask) {
+        end_token(tokenizer, data, base + (size_t) __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+}
+
+// Bytes from offset on, with a lookup per byte
+size_t scan_scalar(tokenizer_t* tokenizer, const char* data, size_t offset, size_t length) {
+    for (; offset < length; offset++) {
+        if (tokenizer->is_delimiter[(unsigned char) data[offset]]) {
+            end_token(tokenizer, data, offset);
+        }
+    }
+    return offset;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// 32 bytes at a time, only called when the CPU has AVX2. Returns the offset of the bytes left for the scalar loop.
+__attribute__((target("avx2")))
+size_t scan_avx2(tokenizer_t* tokenizer, const char* data, size_t offset, size_t length) {
+    __m256i delimiters[MAX_VECTOR_DELIMITERS];
+    for (int i = 0; i < tokenizer->num_delimiters; i++) {
+        delimiters[i] = _mm256_set1_epi8((char) tokenizer->delimiters[i]);
+    }
+    for (; offset + 32 <= length; offset += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (data + offset));
+        __m256i matches = _mm256_cmpeq_epi8(bytes, delimiters[0]);
+        for (int i = 1; i < tokenizer->num_delimiters; i++) {
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(bytes, delimiters[i]));
+        }
+        end_tokens(tokenizer, data, offset, (uint32_t) _mm256_movemask_epi8(matches));
+    }
+    return offset;
+}
+
+// 16 bytes at a time, SSE2 is part of every x86-64 CPU
+size_t scan_sse2(tokenizer_t* tokenizer, const char* data, size_t offset, size_t length) {
+    __m128i delimiters[MAX_VECTOR_DELIMITERS];
+    for (int i = 0; i < tokenizer->num_delimiters; i++) {
+        delimiters[i] = _mm_set1_epi8((char) tokenizer->delimiters[i]);
+    }
+    for (; offset + 16 <= length; offset += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (data + offset));
+        __m128i matches = _mm_cmpeq_epi8(bytes, delimiters[0]);
+        for (int i = 1; i < tokenizer->num_delimiters; i++) {
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(bytes, delimiters[i]));
+        }
+        end_tokens(tokenizer, data, offset, (uint32_t) _mm_movemask_epi8(matches));
+    }
+    return offset;
+}
+
+size_t scan_vector(tokenizer_t* tokenizer, const char* data, size_t length) {
+    static int has_avx2 = -1;  // Same answer for every thread, a race only computes it twice
+    int avx2 = __atomic_load_n(&has_avx2, __ATOMIC_RELAXED);
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&has_avx2, avx2, __ATOMIC_RELAXED);
+    }
+    return avx2 ? scan_avx2(tokenizer, data, 0, length) : scan_sse2(tokenizer, data, 0, length);
+}
+
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+
+// 16 bytes at a time, NEON has no movemask so the comparison is narrowed to 4 bits per byte
+size_t scan_vector(tokenizer_t* tokenizer, const char* data, size_t length) {
+    uint8x16_t delimiters[MAX_VECTOR_DELIMITERS];
+    for (int i = 0; i < tokenizer->num_delimiters; i++) {
+        delimiters[i] = vdupq_n_u8(tokenizer->delimiters[i]);
+    }
+    size_t offset = 0;
+    for (; offset + 16 <= length; offset += 16) {
+        uint8x16_t bytes = vld1q_u8((const uint8_t*) (data + offset));
+        uint8x16_t matches = vceqq_u8(bytes, delimiters[0]);
+        for (int i = 1; i < tokenizer->num_delimiters; i++) {
+            matches = vorrq_u8(matches, vceqq_u8(bytes, delimiters[i]));
+        }
+        // Bit 4 i + 3 is set when byte i is a delimiter
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        for (nibbles &= 0x8888888888888888ULL; nibbles; nibbles &= nibbles - 1) {
+            end_token(tokenizer, data, offset + (size_t) (__builtin_ctzll(nibbles) >> 2));
+        }
+    }
+    return offset;
+}
+
+#else
+
+size_t scan_vector(tokenizer_t* tokenizer, const char* data, size_t length) {
+    (void) tokenizer;
+    (void) data;
+    (void) length;
+    return 0;
+}
+
+#endif
+
+size_t MR_Tokenize(const char* data, size_t length, const char* delimiters, MR_TokenCallback callback, void* argument) {
+    tokenizer_t tokenizer;
+    init_tokenizer(&tokenizer, delimiters, callback, argument);
+    size_t offset = tokenizer.num_delimiters > 0 ? scan_vector(&tokenizer, data, length) : 0;
+    scan_scalar(&tokenizer, data, offset, length);
+    end_token(&tokenizer, data, length);  // The last token has no delimiter after it
+    return tokenizer.num_tokens;
+}
+
+typedef struct emit_value {
+    const char* value;
+    size_t value_length;
+} emit_value_t;
+
+void emit_token(const char* token, size_t token_length, void* argument) {
+    emit_value_t* value = argument;
+    MR_EmitN(token, token_length, value->value, value->value_length);
+}
+
+size_t MR_EmitTokens(const char* data, size_t length, const char* delimiters, const char* value) {
+    emit_value_t emit_value = {value, strlen(value)};
+    return MR_Tokenize(data, length, delimiters, emit_token, &emit_value);
+}
+
+void MR_InitOptions(MR_Options* options) {
+    options->batch_size = DEFAULT_BATCH_SIZE;
+    options->combiner = NULL;
+    options->borrow_values = 0;
+    options->compress_values = 0;
+    options->binary_values = 0;
+    options->split_mapper = NULL;
+    options->split_size = DEFAULT_SPLIT_SIZE;
+    options->shuffle = MR_SHUFFLE_HASH;
+    options->memory_limit = 0;
+    options->spill_directory = NULL;
+    options->pipeline = 0;
+    options->num_partitions = 0;
+    options->hash_seed = 0;
+    options->range_splits = NULL;
+    options->stats = NULL;
+    options->output_directory = NULL;
+    options->output_file = NULL;
+    options->numa = 0;
+    options->stream = 0;
+    options->prefetch = 0;
+    options->cluster = NULL;
+    options->cluster_node = 0;
+    options->task_attempts = 0;
+    options->checkpoint_directory = NULL;
+    options->checkpoint_id = NULL;
+    options->top_k = 0;
+}
+
+// Longest run of slots probed to find a key of the table
+unsigned long longest_probe(table_t* table) {
+    unsigned long longest = 0;
+    unsigned long mask = table->capacity - 1;
+    for (unsigned long i = 0; i < table->capacity; i++) {
+        if (table->slots[i].entry) {
+            unsigned long probes = ((i - table->slots[i].hash) & mask) + 1;
+            if (probes > longest) {
+                longest = probes;
+            }
+        }
+    }
+    return longest;
+}
 
-    // Get or create the entry for the key
-    entry_t* entry = get_entry(key);
+// Copies the counters of the run in the stats, the arrays are allocated for the caller
+void fill_stats(MR_Stats* stats, int num_mappers) {
+    stats->num_mappers = num_mappers;
+    stats->num_reducers = context_->num_reducers;
+    stats->num_partitions = context_->num_partitions;
+    stats->mapper_busy = context_->mapper_busy;
+    stats->reducer_busy = context_->reducer_busy;
+    context_->mapper_busy = NULL;
+    context_->reducer_busy = NULL;
+    stats->emits = context_->total_emits;
+    stats->partition_keys = malloc(context_->num_partitions * sizeof(size_t));
+    stats->partition_emits = malloc(context_->num_partitions * sizeof(size_t));
+    assert(stats->partition_keys && stats->partition_emits);
+    stats->max_probe_length = 0;
+    for (int i = 0; i < context_->num_partitions; i++) {
+        stats->partition_keys[i] = context_->partitions[i].keys;
+        stats->partition_emits[i] = context_->partitions[i].size;
+        unsigned long probes = longest_probe(&context_->partitions[i].table);
+        if (probes > stats->max_probe_length) {
+            stats->max_probe_length = probes;
+        }
+    }
+    stats->lock_wait_time = context_->lock_wait * 1e-9;
+    stats->hot_keys = context_->hot_keys;
+    stats->bytes_allocated = context_->bytes_allocated;
+}
 
-    // Create a new Level 2 node for the value
-    values_t* value_ = malloc(sizeof(values_t));
-    value_->value = strdup(value);  // Copy the value
-    value_->next = entry->head;     // Insert at the beginning of the Level 2 list
-    entry->head = value_;
+void MR_FreeStats(MR_Stats* stats) {
+    free(stats->mapper_busy);
+    free(stats->reducer_busy);
+    free(stats->partition_keys);
+    free(stats->partition_emits);
+    stats->mapper_busy = stats->reducer_busy = NULL;
+    stats->partition_keys = stats->partition_emits = NULL;
+}
 
-    pthread_mutex_unlock(&partitions[partition_number].lock);  // Unlock after modification
+// Starts the reducer threads
+void start_reducers(worker_t** reducer_threads, Reducer reduce, int num_reducers) {
+    for (int i = 0; i < num_reducers; i++) {
+        reduce_args_t * reduceArgs = malloc(sizeof(reduce_args_t));
+        reduceArgs->reducer = reduce;
+        reduceArgs->reducer_num = i;
+        reducer_threads[i] = pool_start((void *) reduce_, (void *) reduceArgs);
+    }
 }
 
 // MR_Run implementation: Runs the Map-Reduce process
 void MR_Run(int argc, char* argv[], Mapper map, int num_mappers, Reducer reduce, int num_reducers, Partitioner partitioner) {
+    MR_Options options;
+    MR_InitOptions(&options);
+    MR_RunWithOptions(argc, argv, map, num_mappers, reduce, num_reducers, partitioner, &options);
+}
+
+void MR_RunWithOptions(int argc, char* argv[], Mapper map, int num_mappers, Reducer reduce, int num_reducers, Partitioner partitioner,
+                       MR_Options* options) {
+    MR_Context* context = MR_CreateContext();
+    MR_RunContext(context, argc, argv, map, num_mappers, reduce, num_reducers, partitioner, options);
+    MR_DestroyContext(context);
+}
+
+MR_Context* MR_CreateContext() {
+    MR_Context* context = calloc(1, sizeof(MR_Context));
+    assert(context);
+    pthread_mutex_init(&context->arenas_lock, NULL);
+    pthread_mutex_init(&context->prefetch_lock, NULL);
+    pthread_mutex_init(&context->coordinator_lock, NULL);
+    pthread_mutex_init(&context->task_lock, NULL);
+    pthread_cond_init(&context->task_changed, NULL);
+    pthread_cond_init(&context->prefetch_changed, NULL);
+    return context;
+}
+
+// Frees the chunks kept for the next runs, and ends the stream
+void MR_ResetContext(MR_Context* context) {
+    if (context->stream_states) {
+        MR_Context* caller_context = context_;  // The chunks go back to this context, which then frees them
+        context_ = context;
+        free_stream_states(context->stream_states, context->num_stream_states);
+        context_ = caller_context;
+        context->stream_states = NULL;
+        context->num_stream_states = 0;
+    }
+    pthread_mutex_lock(&context->arenas_lock);
+    while (context->free_chunks) {
+        chunk_t* chunk = context->free_chunks;
+        context->free_chunks = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_unlock(&context->arenas_lock);
+}
+
+void MR_DestroyContext(MR_Context* context) {
+    while (context->workers) {
+        worker_t* worker = context->workers;
+        context->workers = worker->next;
+        pthread_mutex_lock(&worker->lock);
+        worker->exiting = 1;
+        pthread_cond_signal(&worker->changed);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->changed);
+        free(worker);
+    }
+    MR_ResetContext(context);
+    pthread_mutex_destroy(&context->arenas_lock);
+    pthread_mutex_destroy(&context->prefetch_lock);
+    pthread_mutex_destroy(&context->coordinator_lock);
+    pthread_mutex_destroy(&context->task_lock);
+    pthread_cond_destroy(&context->task_changed);
+    pthread_cond_destroy(&context->prefetch_changed);
+    if (__atomic_load_n(&running_context_, __ATOMIC_RELAXED) == context) {
+        __atomic_store_n(&running_context_, NULL, __ATOMIC_RELAXED);
+    }
+    free(context);
+}
+
+void MR_RunContext(MR_Context* context, int argc, char* argv[], Mapper map, int num_mappers, Reducer reduce, int num_reducers,
+                   Partitioner partitioner, MR_Options* options) {
+    MR_Context* caller_context = context_;  // The caller may itself be working for another run
+    context_ = context;
+    __atomic_store_n(&running_context_, context, __ATOMIC_RELAXED);
+    double start = wall_time();
+    context_->total_emits = 0;
+    context_->lock_wait = 0;
+    context_->hot_keys = 0;
+    context_->bytes_allocated = 0;
+    context_->num_nodes = 1;
+    context_->node = 0;
+    context_->coordinator_fd = -1;
+    context_->task_attempts = options->task_attempts > 0 || options->checkpoint_directory ? options->task_attempts : 0;
+    if (options->checkpoint_directory && context_->task_attempts < 1) {
+        context_->task_attempts = 1;
+    }
+    context_->checkpoint_directory = options->checkpoint_directory;
+    context_->checkpoint_id = options->checkpoint_id;
     // Initialize partitions and threads
-    num_partitions = num_reducers;
-    partitioner_ = partitioner;
-    partitions = malloc(num_partitions * sizeof(partition_t));
-    for (int i = 0; i < num_partitions; i++) {  // Initialize the partitions
-        partitions[i].head = NULL;
-        pthread_mutex_init(&partitions[i].lock, NULL);  // Initialize partition lock
+    context_->num_partitions = options->num_partitions > 0 ? options->num_partitions : num_reducers;
+    context_->num_reducers = num_reducers;
+    context_->hash_seed = options->hash_seed;
+    context_->partitioner = partitioner;
+    context_->batch_size = options->batch_size;
+    context_->combiner = options->combiner;
+    context_->borrow_values = options->borrow_values;
+    context_->compress_values = options->compress_values;
+    context_->binary_values = options->binary_values;
+    context_->shuffle = options->shuffle;
+    context_->memory_limit = options->memory_limit;
+    context_->memory_used = 0;
+    context_->spill_directory = options->spill_directory;
+    if (context_->memory_limit > 0) {  // Only sorted runs can be spilled
+        context_->shuffle = MR_SHUFFLE_SORT;
+    }
+    context_->pipeline = options->pipeline && context_->shuffle == MR_SHUFFLE_HASH;
+    context_->output_directory = options->output_directory;
+    context_->output_file = options->output_file;
+    context_->top_k = options->top_k;
+    context_->stream = options->stream;
+    if (!context_->stream && context_->stream_states) {  // The stream ended
+        free_stream_states(context_->stream_states, context_->num_stream_states);
+        context_->stream_states = NULL;
+        context_->num_stream_states = 0;
+    }
+    context_->replay_states = context_->stream_states;  // Emitted again by the mappers
+    context_->num_replay_states = context_->num_stream_states;
+    context_->next_replay_state = 0;
+    context_->num_stream_states = context_->stream ? context_->num_partitions : 0;
+    context_->stream_states = context_->stream ? create_stream_states(context_->num_partitions) : NULL;
+    context_->numa = options->numa;
+    if (context_->numa) {
+        pthread_once(&nodes_once_, discover_nodes);
+    }
+    context_->partitions = malloc(context_->num_partitions * sizeof(partition_t));
+    for (int i = 0; i < context_->num_partitions; i++) {  // Initialize the partitions
+        init_table(&context_->partitions[i].table);
+        context_->partitions[i].runs = NULL;
+        context_->partitions[i].memory = 0;
+        context_->partitions[i].size = 0;
+        context_->partitions[i].keys = 0;
+        context_->partitions[i].output_fd = -1;
+        context_->partitions[i].output = NULL;
+        context_->partitions[i].output_length = 0;
+        context_->partitions[i].top.pairs = NULL;
+        context_->partitions[i].top.count = 0;
+        init_buffer(&context_->partitions[i].pending);
+        context_->partitions[i].arena.head = NULL;
+        context_->partitions[i].arena.size = 0;
+        context_->partitions[i].arena.node = partition_node(i);
+        context_->partitions[i].table.node = partition_node(i);
+        context_->partitions[i].pending.arena.node = partition_node(i);
+        pthread_mutex_init(&context_->partitions[i].lock, NULL);  // Initialize partition lock
+    }
+
+    // Only the coordinator of a cluster has a queue, its files must be readable by all the processes
+    int coordinator = !options->cluster || options->cluster_node == 0;
+    assert(!options->cluster || partitioner != MR_RangePartition || options->range_splits);  // Sampled alike by all
+    init_map_tasks(coordinator ? argc : 1, argv, options->split_mapper ? options->split_size : 0);
+    if (coordinator && num_mappers > context_->num_map_tasks + context_->num_replay_states) {  // No use for idle mappers
+        num_mappers = context_->num_map_tasks + context_->num_replay_states;
     }
 
-    pthread_t mapper_threads[num_mappers];  // Initialize mappers
-    pthread_t reducer_threads[num_reducers];  // Initialize reducers
+    worker_t* mapper_threads[num_mappers + 1];  // Initialize mappers
+    worker_t* reducer_threads[num_reducers];  // Initialize reducers
+    context_->mapper_busy = calloc(num_mappers + 1, sizeof(double));
+    context_->reducer_busy = calloc(num_reducers, sizeof(double));
+    assert(context_->mapper_busy && context_->reducer_busy);
+    context_->reduce_tasks = malloc(context_->num_partitions * sizeof(int));
+    assert(context_->reduce_tasks);
+
+    if (context_->pipeline) {  // Reducers start first to merge the batches while mapping goes on
+        context_->inboxes = malloc(num_reducers * sizeof(inbox_t));
+        assert(context_->inboxes);
+        for (int i = 0; i < num_reducers; i++) {
+            context_->inboxes[i].batches = NULL;
+            context_->inboxes[i].closed = 0;
+            pthread_mutex_init(&context_->inboxes[i].lock, NULL);
+            pthread_cond_init(&context_->inboxes[i].ready, NULL);
+        }
+        pthread_barrier_init(&context_->reduce_barrier, NULL, num_reducers);
+        start_reducers(reducer_threads, reduce, num_reducers);
+    }
 
     // Map phase
-    for (int i = 1; i < argc; i++) {  // evenly handle files to reducers
-        pthread_create(&mapper_threads[(i - 1) % num_mappers], NULL, (void *) map, (void *) argv[i]);
+    map_args_t mapArgs[num_mappers + 1];
+    for (int i = 0; i <= num_mappers; i++) {
+        mapArgs[i].mapper = map;
+        mapArgs[i].split_mapper = options->split_mapper;
+        mapArgs[i].mapper_num = i;
+    }
+    if (partitioner == MR_RangePartition && options->range_splits) {
+        context_->range_splits = malloc(context_->num_partitions * sizeof(record_t));
+        assert(context_->range_splits);
+        context_->num_range_splits = context_->num_partitions - 1;
+        for (int i = 0; i < context_->num_range_splits; i++) {
+            context_->range_splits[i].key = options->range_splits[i];
+            context_->range_splits[i].key_length = strlen(options->range_splits[i]);
+        }
+    } else if (partitioner == MR_RangePartition) {  // Mappers run a first time to sample the keys
+        sample_range_splits(mapArgs, num_mappers);
+    }
+    context_->prefetch = options->prefetch;
+    context_->prefetch_done = 0;
+    if (context_->task_attempts > 0) {
+        context_->task_runs = calloc(num_mappers + 1, sizeof(task_run_t));
+        assert(context_->task_runs);
+        context_->num_task_runs = num_mappers;
+        context_->task_time = 0;
+        context_->num_timed_tasks = 0;
+    }
+    if (options->cluster) {  // Frames and task requests may come in as soon as the others are connected
+        join_cluster(options->cluster, options->cluster_node);
+    }
+    for (int i = 0; i < num_mappers; i++) {  // The mappers share the files through the queue
+        mapper_threads[i] = pool_start((void *) map_, (void *) &mapArgs[i]);
+    }
+    worker_t* prefetcher = NULL;
+    if (context_->prefetch > 0 && context_->num_map_tasks > num_mappers) {  // Otherwise every task is taken at once
+        prefetcher = pool_start(prefetch_, NULL);
     }
 
     for (int i = 0; i < num_mappers; i++) {  // Wait for all mapper threads to complete their tasks
-        pthread_join(mapper_threads[i], NULL);
+        pool_join(mapper_threads[i]);
+    }
+    if (prefetcher) {
+        pthread_mutex_lock(&context_->prefetch_lock);
+        context_->prefetch_done = 1;
+        pthread_cond_signal(&context_->prefetch_changed);
+        pthread_mutex_unlock(&context_->prefetch_lock);
+        pool_join(prefetcher);
+    }
+    context_->prefetch = 0;
+    if (options->cluster) {
+        leave_cluster();
+    }
+    free(context_->task_runs);
+    context_->task_runs = NULL;
+    free(context_->map_tasks);
+    if (context_->replay_states) {
+        free_stream_states(context_->replay_states, context_->num_replay_states);
+        context_->replay_states = NULL;
     }
 
+    for (int i = 0; i < context_->num_partitions && context_->shuffle == MR_SHUFFLE_SORT; i++) {  // Sort what was emitted without buffer
+        if (context_->partitions[i].pending.num_emits > 0) {
+            push_run(i, seal_run(&context_->partitions[i].pending, i));
+        }
+    }
+    double map_end = wall_time();
+
     //display_partitions();
 
-    for (int i = 0; i < num_reducers; i++) {
-        reduce_args_t * reduceArgs = malloc(sizeof(reduce_args_t));
-        reduceArgs->reducer = reduce;
-        reduceArgs->partition_num = i;
-        pthread_create(&reducer_threads[i], NULL, (void *) reduce_, (void *) reduceArgs);
+    if (context_->pipeline) {
+        for (int i = 0; i < num_reducers; i++) {  // No more batches, reducers can move on to reducing
+            pthread_mutex_lock(&context_->inboxes[i].lock);
+            context_->inboxes[i].closed = 1;
+            pthread_cond_signal(&context_->inboxes[i].ready);
+            pthread_mutex_unlock(&context_->inboxes[i].lock);
+        }
+    } else {
+        init_reduce_tasks();
+        context_->reduce_start = wall_time();
+        start_reducers(reducer_threads, reduce, num_reducers);
     }
 
     for (int i = 0; i < num_reducers; i++) {
-        pthread_join(reducer_threads[i], NULL);
+        pool_join(reducer_threads[i]);
+    }
+    if (context_->pipeline) {
+        for (int i = 0; i < num_reducers; i++) {
+            pthread_mutex_destroy(&context_->inboxes[i].lock);
+            pthread_cond_destroy(&context_->inboxes[i].ready);
+        }
+        free(context_->inboxes);
+        pthread_barrier_destroy(&context_->reduce_barrier);
+    }
+    if (context_->top_k > 0) {
+        output_top();
+    } else if (!context_->output_directory) {
+        concatenate_outputs();
     }
+    if (options->stats) {
+        MR_Stats* stats = options->stats;
+        double end = wall_time();
+        stats->map_time = map_end - start;
+        stats->shuffle_time = context_->reduce_start - map_end;
+        stats->reduce_time = end - context_->reduce_start;
+        stats->total_time = end - start;
+        fill_stats(stats, num_mappers);
+    }
+    free(context_->mapper_busy);
+    free(context_->reducer_busy);
+    context_->mapper_busy = context_->reducer_busy = NULL;
     cleanup_partitions();
+    free_range_splits();
+    context_ = caller_context;
 
 }
 
 
 unsigned long MR_DefaultHashPartition(char* key, int num_partitions_) {
-    unsigned long hash = 5381;
-    unsigned char c;
-    while ((c = *key++) != '\0') {
-        hash = hash * 33 + c;
-    }
-    return hash % num_partitions_;  // Return partition number
+    return reduce_hash(hash_key(key, strlen(key)), num_partitions_);  // Return partition number
+}
+
+unsigned long MR_DJB2HashPartition(char* key, int num_partitions_) {
+    return djb2_hash(key) % num_partitions_;
+}
+
+unsigned long MR_RangePartition(char* key, int num_partitions_) {
+    (void) num_partitions_;  // The splits were computed for the partitions of the run
+    return range_partition(key, strlen(key));
 }
 
 
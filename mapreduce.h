@@ -1,25 +1,215 @@
 #ifndef __mapreduce_h__
 #define __mapreduce_h__
 
+#include <stddef.h>
+
 // This file should not be modified; if you wish to modify it,
 // please let us know.
 
 // Different function pointer types used by MR
 typedef char *(*Getter)(char *key, int partition_number);
 typedef void (*Mapper)(char *file_name);
+// Maps the length bytes of the file starting at offset, a split always starts and ends on a record boundary (newline)
+typedef void (*SplitMapper)(char *file_name, long offset, long length);
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
+// Reads the values a mapper buffered for the key with get_func, and returns one malloc'd value replacing them
+typedef char *(*Combiner)(char *key, Getter get_func, int partition_number);
+
+// How emitted pairs are grouped by key before the reduce phase
+typedef enum MR_Shuffle {
+    MR_SHUFFLE_HASH,  // Hash table per partition, keys are reduced in no particular order
+    MR_SHUFFLE_SORT   // Sorted runs merged before reducing, keys are reduced in byte order
+} MR_Shuffle;
+
+// What a run did, filled by MR_RunWithOptions when options->stats is set, its arrays are freed by MR_FreeStats
+typedef struct MR_Stats {
+    double map_time;  // Seconds from the start of the run to the end of the map phase
+    double shuffle_time;  // Then until the partitions can be reduced (pipeline mode: until the last batch is merged)
+    double reduce_time;  // Then until the last partition is reduced
+    double total_time;
+    int num_mappers;  // Threads that actually ran, there are no more mappers than files or splits
+    int num_reducers;
+    int num_partitions;
+    double *mapper_busy;  // Seconds each mapper thread spent in the Mapper
+    double *reducer_busy;  // Seconds each reducer thread spent merging batches and reducing
+    unsigned long emits;
+    size_t *partition_keys;  // Distinct keys reduced in each partition
+    size_t *partition_emits;  // Emits merged in each partition, after combining
+    unsigned long max_probe_length;  // Most slots probed to find a key in a partition table (hash shuffle)
+    double lock_wait_time;  // Seconds threads spent waiting for partition locks, all threads added up
+    size_t bytes_allocated;  // Arena chunks, table slots and record arrays
+    unsigned long hot_keys;  // Times a mapper buffer found a key holding 1/8 of its batch (hash shuffle), see batch_size
+} MR_Stats;
+
+// Tuning of a run, MR_InitOptions fills it with the defaults used by MR_Run
+typedef struct MR_Options {
+    int batch_size;  // Emits a mapper buffers per partition before merging them, 1 disables buffering. The emits of
+                     //   hot keys (combined early, or held) don't count, up to 16 batches.
+    Combiner combiner;  // Run on the buffered values of each key before merging them, NULL by default
+    int borrow_values;  // If set, values returned by the Getter belong to MR_Run, they must not be freed
+                        //   and stay valid until the Reducer returns
+    int compress_values;  // If set, a value equal to the one stored before it is kept once (values are read only)
+    int binary_values;  // If set, values keep their length and may hold NUL bytes (see MR_EmitBytes), this costs 4 bytes
+                        //   per value with the hash shuffle, the sort shuffle always keeps them. A Combiner returns
+                        //   binary values with MR_CombinedBytes.
+    SplitMapper split_mapper;  // Replaces the Mapper when set, big files are then mapped by several threads
+    long split_size;  // Files bigger than this are cut in splits of about this size for the split mapper
+    int prefetch;  // Files or splits read ahead of the mappers by a helper thread, 0 (the default) for none
+    MR_Shuffle shuffle;  // MR_SHUFFLE_HASH by default, with MR_SHUFFLE_SORT a Getter only returns values of its key
+    size_t memory_limit;  // Bytes of intermediate data kept in memory before spilling to disk, implies MR_SHUFFLE_SORT
+    char *spill_directory;  // Where spill files are created, $TMPDIR or /tmp if NULL
+    int pipeline;  // If set, reducers merge and combine mapper batches during the map phase (hash shuffle only)
+    int num_partitions;  // Passed to the Partitioner, reducers share the partitions, 0 for one per reducer
+    unsigned long hash_seed;  // Seed of the hash used by MR_DefaultHashPartition and the tables, 0 by default
+    char **range_splits;  // Sorted keys separating the num_partitions partitions of MR_RangePartition (one less
+                          //   than the partitions), sampled from the input when NULL
+    MR_Stats *stats;  // Filled at the end of the run if not NULL
+    char *output_directory;  // MR_Output writes partition p to output_directory/part-p (5 digits) if set
+    char *output_file;  // Otherwise the partitions are written in order to this file, or to the standard output
+    int numa;  // If set, threads are pinned to the NUMA nodes and partitions placed on the node of their reducer
+    char **cluster;  // If set, the run is shared by the processes listening on these "host:port" (NULL terminated,
+                     //   IPv4), which all run it with the same options and functions, only cluster_node differing
+    int cluster_node;  // Index of this process in cluster. Process 0 hands the files of its argv out to the mappers of
+                       //   all, the files must be readable by all of them. Partition p is reduced and output by
+                       //   process p % (processes), MR_RangePartition needs range_splits.
+    int task_attempts;  // If set, every map task runs in a child process, and is run again up to this many attempts
+                        //   when it crashes (the run aborts if every attempt fails). Tasks much slower than the
+                        //   others get a copy once the queue is empty.
+    char *checkpoint_directory;  // Where the outputs of the tasks (run in child processes) are kept, a run finding
+                                 //   the output of a task emits it instead of mapping the task again
+    char *checkpoint_id;  // Names the job's checkpoints with the options deciding them (NULL for none). The mapper,
+                          //   combiner and a custom partitioner aren't known across builds: a job changing them
+                          //   must change its id, or its next runs emit the outputs of the old one.
+    int stream;  // If set, the values of every key are combined and kept in the context after being reduced, and its
+                 //   next run adds them to its input: every run maps new files and the Reducer sees the values of the
+                 //   whole stream (its emits are counted in the stats). A run without it or MR_ResetContext ends the stream.
+    int top_k;  // If set, only the top_k pairs output with the biggest numeric values (ties in key order) are kept, and
+                //   written by decreasing value at the end of the run instead of the partitions, to output_file (or
+                //   the standard output) or output_directory/top-n, n being cluster_node. Each process keeps its own.
+} MR_Options;
+
+// Read only view of (part of) an input file, mapped in memory by MR_OpenInput
+typedef struct MR_Input {
+    const char *data;  // First byte of the view, not NUL terminated
+    long length;
+    long position;  // Offset in data of the next record
+    void *mapping;
+    size_t mapping_length;
+} MR_Input;
 
 // External functions: these are what you must define
 void MR_Emit(char *key, char *value);
 
+// Same as MR_Emit for keys and values that are not NUL terminated, both are copied
+void MR_EmitN(const char *key, size_t key_length, const char *value, size_t value_length);
+
+// Emits binary data: the key may hold NUL bytes, and so may the value with binary_values (or MR_SHUFFLE_SORT).
+//   Partitioners other than MR_DefaultHashPartition and MR_RangePartition see the key up to its first NUL byte, and
+//   so does a Reducer using strlen, the length of the key it reduces is given by MR_KeyLength.
+void MR_EmitBytes(const void *key, size_t key_length, const void *value, size_t value_length);
+
+// MR_EmitBytes to a partition chosen by the caller (below MR_NumPartitions), the Partitioner of the run isn't called.
+//   The C++ front-end (mapreduce.hpp) emits this way with its own partitioner.
+void MR_EmitPartitioned(unsigned long partition_number, const void *key, size_t key_length,
+                        const void *value, size_t value_length);
+
+// Partitions of the run the calling thread maps for
+int MR_NumPartitions(void);
+
+// Called by Reducers to output the line "key value", buffered and written in blocks (see output_directory),
+//   the lines of a partition are in the order they were output, the partitions are never interleaved.
+void MR_Output(char *key, char *value);
+
+void MR_OutputN(const char *key, size_t key_length, const char *value, size_t value_length);
+
+// Maps length bytes of the file from offset (-1 meaning up to the end), returns 0 on success and -1 on error
+int MR_OpenInput(char *file_name, long offset, long length, MR_Input *input);
+
+// Points record to the next line of the input, newline included, returns 0 once the input is exhausted
+int MR_NextRecord(MR_Input *input, const char **record, size_t *record_length);
+
+void MR_CloseInput(MR_Input *input);
+
+// Called with every token MR_Tokenize finds, the token points in the data and is not NUL terminated
+typedef void (*MR_TokenCallback)(const char *token, size_t token_length, void *argument);
+
+// Cuts length bytes of data at every byte of delimiters (" \t\n\r" if NULL), and calls callback with each
+//   non empty token in order. Returns the number of tokens.
+size_t MR_Tokenize(const char *data, size_t length, const char *delimiters, MR_TokenCallback callback, void *argument);
+
+// MR_Tokenize emitting every token with the value, returns the number of emits
+size_t MR_EmitTokens(const char *data, size_t length, const char *delimiters, const char *value);
+
+// Batch Getter for Reducers and Combiners, points values to the next values of the key and returns how many there
+//   are, 0 once they have all been read. The values are read as with the Getter, but they are never copied: like
+//   with borrow_values they must not be freed and stay valid until the Reducer returns.
+size_t MR_GetValues(char *key, int partition_number, char ***values);
+
+// Getter of binary values, points value to the next value of the key and length to its length, returns 0 once they
+//   have all been read. Like with MR_GetValues the value isn't copied (it is followed by a NUL byte all the same).
+int MR_GetBytes(char *key, int partition_number, const void **value, size_t *length);
+
+// Length of the key a Reducer or Combiner was called with, which may hold NUL bytes
+size_t MR_KeyLength(char *key);
+
+// Built-in Reducers, they read the values with MR_GetValues (MR_GetBytes for min and max with binary_values) and
+//   output one pair per key, binary keys included (see MR_KeyLength)
+void MR_CountReducer(char *key, Getter get_func, int partition_number);  // Number of values
+void MR_SumReducer(char *key, Getter get_func, int partition_number);  // Sum of the values, read as integers
+void MR_MinReducer(char *key, Getter get_func, int partition_number);  // Numerically smallest value, as emitted
+void MR_MaxReducer(char *key, Getter get_func, int partition_number);  // Numerically biggest value, as emitted
+
+// Value for a Combiner to return when it may hold NUL bytes (with binary_values), instead of a malloc'd string.
+//   The library frees it, it must be the last one the Combiner made.
+char *MR_CombinedBytes(const void *value, size_t length);
+
+// Combiners of the built-in Reducers, counts are combined by emitting "1" and using MR_SumReducer
+char *MR_SumCombiner(char *key, Getter get_func, int partition_number);
+char *MR_MinCombiner(char *key, Getter get_func, int partition_number);
+char *MR_MaxCombiner(char *key, Getter get_func, int partition_number);
+
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
 
+// Partitioner of the previous versions (djb2 modulo num_partitions), to reproduce their partitions
+unsigned long MR_DJB2HashPartition(char *key, int num_partitions);
+
+// Keys of partition p sort (in byte order) after those of partition p - 1, with MR_SHUFFLE_SORT writing
+//   the reduced partitions one after the other gives a totally ordered output.
+// The mappers are run a first time on the beginning of the splits (or on a few files without a split mapper)
+//   to sample the keys, unless range_splits is set. Their emits are then only sampled.
+unsigned long MR_RangePartition(char *key, int num_partitions);
+
 void MR_Run(int argc, char *argv[], 
 	    Mapper map, int num_mappers, 
 	    Reducer reduce, int num_reducers, 
 	    Partitioner partition);
 
+void MR_InitOptions(MR_Options *options);
+
+void MR_FreeStats(MR_Stats *stats);
+
+void MR_RunWithOptions(int argc, char *argv[],
+		       Mapper map, int num_mappers,
+		       Reducer reduce, int num_reducers,
+		       Partitioner partition, MR_Options *options);
+
+// State of the runs of a job, whose threads and memory are kept from one run to the next.
+// Several contexts can run at once, from different threads. MR_RunWithOptions runs on a context of its own.
+typedef struct MR_Context MR_Context;
+
+MR_Context *MR_CreateContext(void);
+
+void MR_RunContext(MR_Context *context, int argc, char *argv[],
+		   Mapper map, int num_mappers,
+		   Reducer reduce, int num_reducers,
+		   Partitioner partition, MR_Options *options);
+
+// Frees the memory the context keeps for its next runs (its stream included), its threads are kept
+void MR_ResetContext(MR_Context *context);
+
+void MR_DestroyContext(MR_Context *context);
+
 
 
 #endif // __mapreduce_h__
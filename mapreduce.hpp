@@ -0,0 +1,296 @@
+#ifndef __mapreduce_hpp__
+#define __mapreduce_hpp__
+
+// Header only C++ front-end of the library (C++17), the C API of mapreduce.h is unchanged.
+//
+// mr::Job is specialized on its Mapper, Reducer, Partitioner and Combiner, which are function objects: they are called
+//   directly instead of through function pointers, so the partitioner of every emit and the loop over the values are
+//   inlined. Keys and values are typed (std::string or trivially copyable types such as integers and structs), they
+//   are emitted as their bytes (MR_EmitPartitioned, binary_values) and read back without being converted to text.
+//
+//   struct Map {
+//       void operator()(const char* file_name, mr::Emitter<std::string, long>& emit) const;  // emit(word, 1L)
+//   };
+//   struct Sum {
+//       void operator()(const std::string& key, mr::Values<long>& values) const {
+//           long sum = 0;
+//           for (long value : values) sum += value;
+//           mr::Output(key, sum);
+//       }
+//   };
+//   mr::Job<Map, Sum, mr::HashPartitioner, std::string, long> job;
+//   job.run(argc, argv, 8, 8);
+//
+// A Mapper taking (file_name, offset, length, emit) is run as the split mapper. A Combiner returns the value replacing
+//   the values it reads: ValueT operator()(const KeyT& key, mr::Values<ValueT>& values).
+// The functions of the job are reached through a static pointer (the C API has no user data), so a Job type runs
+//   one job at a time: run aborts if another job of the same type is running. They must not throw.
+//
+// built using : gcc -O2 -c mapreduce.c && g++ -std=c++17 -O2 -I. job.cpp mapreduce.o -pthread
+
+#include <atomic>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+extern "C" {
+#include "mapreduce.h"
+}
+
+namespace mr {
+
+// Bytes a key or value is emitted as, a trivially copyable type is its own representation
+template <typename T>
+struct Codec {
+    static_assert(std::is_trivially_copyable<T>::value, "keys and values are std::string or trivially copyable");
+    static constexpr bool fixed_size = true;  // Values are read in blocks, their length being known
+    static const void* data(const T& value) { return &value; }
+    static size_t size(const T&) { return sizeof(T); }
+    static T decode(const void* data, size_t) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+};
+
+template <>
+struct Codec<std::string> {
+    static constexpr bool fixed_size = false;
+    static const void* data(const std::string& value) { return value.data(); }
+    static size_t size(const std::string& value) { return value.size(); }
+    static std::string decode(const void* data, size_t length) {
+        return std::string(static_cast<const char*>(data), length);
+    }
+};
+
+// Text MR_Output writes for a key or value, numbers in decimal
+template <typename T>
+class Text {
+public:
+    explicit Text(const T& value) {
+        if constexpr (std::is_integral<T>::value) {
+            data_ = buffer_;
+            length_ = std::to_chars(buffer_, buffer_ + sizeof(buffer_), value).ptr - buffer_;
+        } else if constexpr (std::is_floating_point<T>::value) {
+            data_ = buffer_;
+            length_ = std::snprintf(buffer_, sizeof(buffer_), "%.17g", static_cast<double>(value));
+        } else {  // Strings, written as they are
+            data_ = value.data();
+            length_ = value.size();
+        }
+    }
+    const char* data() const { return data_; }
+    size_t size() const { return length_; }
+
+private:
+    char buffer_[32];
+    const char* data_;
+    size_t length_;
+};
+
+// Outputs the line "key value" from a Reducer (see MR_Output)
+template <typename K, typename V>
+void Output(const K& key, const V& value) {
+    Text<K> key_text(key);
+    Text<V> value_text(value);
+    MR_OutputN(key_text.data(), key_text.size(), value_text.data(), value_text.size());
+}
+
+// Values of the key a Reducer or Combiner is called with, read once with next or a range for loop. Fixed size values
+//   are decoded from the blocks of MR_GetValues, without a call per value.
+template <typename ValueT>
+class Values {
+public:
+    Values(char* key, int partition_number) : key_(key), partition_number_(partition_number) {}
+
+    // Reads the next value, returns false once they have all been read
+    bool next(ValueT& value) {
+        if constexpr (Codec<ValueT>::fixed_size) {
+            if (index_ == count_) {
+                count_ = MR_GetValues(key_, partition_number_, &block_);
+                index_ = 0;
+                if (count_ == 0) {
+                    return false;
+                }
+            }
+            value = Codec<ValueT>::decode(block_[index_++], sizeof(ValueT));
+            return true;
+        } else {
+            const void* data;
+            size_t length;
+            if (!MR_GetBytes(key_, partition_number_, &data, &length)) {
+                return false;
+            }
+            value = Codec<ValueT>::decode(data, length);
+            return true;
+        }
+    }
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = ValueT;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const ValueT*;
+        using reference = const ValueT&;
+
+        iterator() : values_(nullptr) {}
+        explicit iterator(Values* values) : values_(values) { ++*this; }
+        const ValueT& operator*() const { return value_; }
+        const ValueT* operator->() const { return &value_; }
+        iterator& operator++() {
+            if (!values_->next(value_)) {
+                values_ = nullptr;
+            }
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return values_ == other.values_; }
+        bool operator!=(const iterator& other) const { return values_ != other.values_; }
+
+    private:
+        Values* values_;  // nullptr once the values are read
+        ValueT value_{};
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    char* key_;
+    int partition_number_;
+    char** block_ = nullptr;  // Fixed size values, block being read
+    size_t count_ = 0;
+    size_t index_ = 0;
+};
+
+// std::hash of the key, or for keys without one (structs) FNV-1a of the bytes they are emitted as, mixed since
+//   std::hash is the identity for integers. A struct with padding needs its own Partitioner, or its padding zeroed.
+struct HashPartitioner {
+    template <typename KeyT>
+    unsigned long operator()(const KeyT& key, int num_partitions) const {
+        unsigned long hash;
+        if constexpr (std::is_default_constructible<std::hash<KeyT>>::value) {  // Disabled hashes can't be built
+            hash = static_cast<unsigned long>(std::hash<KeyT>()(key));
+        } else {
+            const unsigned char* bytes = static_cast<const unsigned char*>(Codec<KeyT>::data(key));
+            hash = 0xcbf29ce484222325UL;
+            for (size_t i = 0; i < Codec<KeyT>::size(key); i++) {
+                hash = (hash ^ bytes[i]) * 0x100000001b3UL;
+            }
+        }
+        hash *= 0x9e3779b97f4a7c15UL;
+        return (hash >> 32) % static_cast<unsigned long>(num_partitions);
+    }
+};
+
+// Emits the pairs of a Mapper to the partition its Partitioner picks, called inline
+template <typename KeyT, typename ValueT, typename Partitioner = HashPartitioner>
+class Emitter {
+public:
+    explicit Emitter(const Partitioner& partitioner) : partitioner_(partitioner), num_partitions_(MR_NumPartitions()) {}
+
+    void operator()(const KeyT& key, const ValueT& value) const {
+        unsigned long partition_number = partitioner_(key, num_partitions_);
+        MR_EmitPartitioned(partition_number, Codec<KeyT>::data(key), Codec<KeyT>::size(key),
+                           Codec<ValueT>::data(value), Codec<ValueT>::size(value));
+    }
+
+private:
+    const Partitioner& partitioner_;
+    int num_partitions_;
+};
+
+// Combiner of a Job whose values aren't combined
+struct NoCombiner {};
+
+template <typename Mapper, typename Reducer, typename Partitioner = HashPartitioner, typename KeyT = std::string,
+          typename ValueT = std::string, typename Combiner = NoCombiner>
+class Job {
+public:
+    using Emitter = mr::Emitter<KeyT, ValueT, Partitioner>;
+    using Values = mr::Values<ValueT>;
+
+    explicit Job(Mapper mapper = Mapper(), Reducer reducer = Reducer(), Partitioner partitioner = Partitioner(),
+                 Combiner combiner = Combiner())
+        : mapper_(mapper), reducer_(reducer), partitioner_(partitioner), combiner_(combiner) {
+        MR_InitOptions(&options_);
+    }
+
+    // Options of the runs, combiner, split_mapper and binary_values are set by the job
+    MR_Options& options() { return options_; }
+
+    void run(int argc, char* argv[], int num_mappers, int num_reducers) {
+        run(nullptr, argc, argv, num_mappers, num_reducers);
+    }
+
+    // Runs on the context if not NULL, or on a context of its own
+    void run(MR_Context* context, int argc, char* argv[], int num_mappers, int num_reducers) {
+        MR_Options options = options_;
+        options.binary_values = 1;
+        options.combiner = std::is_same<Combiner, NoCombiner>::value ? nullptr : combine;
+        options.split_mapper = maps_splits ? map_split : nullptr;
+        Job* idle = nullptr;
+        if (!running_.compare_exchange_strong(idle, this)) {  // One job of this type at a time
+            std::fprintf(stderr, "mr::Job: a job of this type is already running\n");
+            std::abort();
+        }
+        ::Mapper map = maps_splits ? nullptr : map_file;
+        if (context) {
+            MR_RunContext(context, argc, argv, map, num_mappers, reduce, num_reducers, MR_DefaultHashPartition, &options);
+        } else {
+            MR_RunWithOptions(argc, argv, map, num_mappers, reduce, num_reducers, MR_DefaultHashPartition, &options);
+        }
+        running_.store(nullptr);
+    }
+
+private:
+    static constexpr bool maps_splits = std::is_invocable<Mapper&, const char*, long, long, Emitter&>::value;
+
+    static Job* job() { return running_.load(std::memory_order_relaxed); }
+
+    static void map_file(char* file_name) {
+        if constexpr (!maps_splits) {
+            Emitter emit(job()->partitioner_);
+            job()->mapper_(static_cast<const char*>(file_name), emit);
+        }
+    }
+
+    static void map_split(char* file_name, long offset, long length) {
+        if constexpr (maps_splits) {
+            Emitter emit(job()->partitioner_);
+            job()->mapper_(static_cast<const char*>(file_name), offset, length, emit);
+        }
+    }
+
+    static void reduce(char* key, Getter get_next, int partition_number) {
+        (void) get_next;
+        Values values(key, partition_number);
+        job()->reducer_(Codec<KeyT>::decode(key, MR_KeyLength(key)), values);
+    }
+
+    static char* combine(char* key, Getter get_next, int partition_number) {
+        (void) get_next;
+        if constexpr (std::is_same<Combiner, NoCombiner>::value) {
+            return nullptr;
+        } else {
+            Values values(key, partition_number);
+            ValueT combined = job()->combiner_(Codec<KeyT>::decode(key, MR_KeyLength(key)), values);
+            return MR_CombinedBytes(Codec<ValueT>::data(combined), Codec<ValueT>::size(combined));
+        }
+    }
+
+    Mapper mapper_;
+    Reducer reducer_;
+    Partitioner partitioner_;
+    Combiner combiner_;
+    MR_Options options_;
+    inline static std::atomic<Job*> running_{nullptr};
+};
+
+}  // namespace mr
+
+#endif  // __mapreduce_hpp__